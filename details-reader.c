@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "details-reader.h"
+
+#define DETAILS_READ_CHUNK (64 * 1024)
+
+/* Shorten @len so that @buf does not end in a partial UTF-8 sequence */
+static size_t
+utf8_trim_partial(const char *buf, size_t len)
+{
+	size_t start = len;
+	int nr_continuation = 0;
+	while (start > 0 && nr_continuation < 3
+			&& ((unsigned char)buf[start - 1] & 0xC0) == 0x80) {
+		--start;
+		++nr_continuation;
+	}
+	if (start == 0) {
+		return len;
+	}
+	unsigned char lead = buf[start - 1];
+	int needed = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+	return nr_continuation < needed ? start - 1 : len;
+}
+
+/* Returns the length of the first @max_lines lines of @buf */
+static size_t
+limit_lines(const char *buf, size_t len, size_t max_lines)
+{
+	const char *p = buf;
+	for (size_t i = 0; i < max_lines; i++) {
+		p = memchr(p, '\n', buf + len - p);
+		if (!p) {
+			return len;
+		}
+		++p;
+	}
+	return p - buf;
+}
+
+size_t
+details_trim(const char *buf, size_t len, size_t max_bytes, size_t max_lines)
+{
+	if (max_bytes && len >= max_bytes) {
+		len = utf8_trim_partial(buf, max_bytes);
+	}
+	if (max_lines) {
+		len = limit_lines(buf, len, max_lines);
+	}
+	while (len && buf[len - 1] == '\n') {
+		--len;
+	}
+	return len;
+}
+
+/* The head is complete, give what is left of the byte budget to the tail */
+static void
+start_tail(struct details_reader *reader)
+{
+	size_t budget = reader->max_bytes ? reader->max_bytes : DETAILS_MAX_BYTES;
+	reader->head_done = true;
+	reader->ring_capacity = budget > reader->len ? budget - reader->len : 0;
+}
+
+void
+details_reader_init(struct details_reader *reader, size_t max_bytes,
+		size_t max_lines, size_t tail_lines)
+{
+	*reader = (struct details_reader){
+		.max_bytes = max_bytes,
+		.max_lines = max_lines,
+		.tail_lines = tail_lines,
+	};
+	if (tail_lines && !max_lines) {
+		/* Only keep the tail */
+		start_tail(reader);
+	}
+}
+
+static void
+buffer_append(struct details_reader *reader, const char *data, size_t len)
+{
+	if (!len) {
+		return;
+	}
+	if (reader->len + len > reader->size) {
+		size_t size = reader->size ? reader->size : DETAILS_READ_CHUNK;
+		while (size < reader->len + len) {
+			size *= 2;
+		}
+		char *buffer = realloc(reader->buffer, size + 1);
+		assert(buffer);
+		reader->buffer = buffer;
+		reader->size = size;
+	}
+	memcpy(reader->buffer + reader->len, data, len);
+	reader->len += len;
+}
+
+/* The byte budget of the head; in tail mode the rest is left for the ring */
+static size_t
+head_budget(struct details_reader *reader)
+{
+	if (!reader->tail_lines) {
+		return reader->max_bytes;
+	}
+	size_t budget = reader->max_bytes ? reader->max_bytes : DETAILS_MAX_BYTES;
+	/* Zero would mean no limit */
+	return budget > 1 ? budget / 2 : 1;
+}
+
+/* Returns the number of bytes consumed */
+static size_t
+feed_head(struct details_reader *reader, const char *data, size_t len)
+{
+	size_t take = len;
+	bool byte_limited = false;
+
+	size_t budget = head_budget(reader);
+	if (budget && reader->len + take >= budget) {
+		take = budget - reader->len;
+		byte_limited = true;
+	}
+
+	if (reader->max_lines) {
+		const char *p = data;
+		while ((p = memchr(p, '\n', data + take - p))) {
+			++p;
+			if (++reader->nr_lines == reader->max_lines) {
+				take = p - data;
+				byte_limited = false;
+				reader->head_done = true;
+				break;
+			}
+		}
+	}
+
+	buffer_append(reader, data, take);
+
+	if (byte_limited) {
+		reader->head_done = true;
+		reader->head_cut = !reader->len
+			|| reader->buffer[reader->len - 1] != '\n';
+		reader->skip_line = reader->head_cut;
+	}
+	if (reader->head_done && reader->tail_lines) {
+		start_tail(reader);
+	}
+	return take;
+}
+
+static void
+drop_oldest_line(struct details_reader *reader)
+{
+	struct details_tail_line *line = &reader->lines[reader->first_line];
+	reader->ring_used -= line->len;
+	if (reader->ring_size) {
+		reader->ring_start =
+			(reader->ring_start + line->len) % reader->ring_size;
+	}
+	reader->first_line = (reader->first_line + 1) % reader->lines_size;
+	reader->nr_tail_lines--;
+}
+
+/* The part of the tail budget in use, the entries of the lines included */
+static size_t
+tail_used(struct details_reader *reader)
+{
+	return reader->ring_used
+		+ reader->nr_tail_lines * sizeof(*reader->lines);
+}
+
+/*
+ * Make room for one more line. The array of lines grows as they arrive, up
+ * to tail_lines entries, and is unwrapped when it does.
+ */
+static void
+lines_reserve(struct details_reader *reader)
+{
+	if (reader->nr_tail_lines < reader->lines_size) {
+		return;
+	}
+	size_t size = reader->lines_size ? reader->lines_size * 2 : 64;
+	if (size > reader->tail_lines) {
+		size = reader->tail_lines;
+	}
+	/* Never more entries than the budget could hold */
+	size_t fit = reader->ring_capacity / sizeof(*reader->lines) + 1;
+	if (size > fit) {
+		size = fit;
+	}
+	struct details_tail_line *lines = malloc(size * sizeof(*lines));
+	assert(lines);
+	for (size_t i = 0; i < reader->nr_tail_lines; i++) {
+		lines[i] = reader->lines[(reader->first_line + i)
+			% reader->lines_size];
+	}
+	free(reader->lines);
+	reader->lines = lines;
+	reader->lines_size = size;
+	reader->first_line = 0;
+}
+
+/*
+ * Make room for @len more bytes. The ring grows geometrically up to its
+ * capacity and only starts wrapping around once it got there, so while it
+ * grows its content is always contiguous.
+ */
+static void
+ring_reserve(struct details_reader *reader, size_t len)
+{
+	if (reader->ring_size == reader->ring_capacity
+			|| reader->ring_start + reader->ring_used + len
+				<= reader->ring_size) {
+		return;
+	}
+
+	if (reader->ring_start) {
+		memmove(reader->ring, reader->ring + reader->ring_start,
+			reader->ring_used);
+		for (size_t i = 0; i < reader->nr_tail_lines; i++) {
+			size_t index = (reader->first_line + i) % reader->lines_size;
+			reader->lines[index].start -= reader->ring_start;
+		}
+		reader->ring_start = 0;
+	}
+	if (reader->ring_used + len <= reader->ring_size) {
+		return;
+	}
+
+	size_t size = reader->ring_size ? reader->ring_size : DETAILS_READ_CHUNK;
+	while (size < reader->ring_used + len) {
+		size *= 2;
+	}
+	if (size > reader->ring_capacity) {
+		size = reader->ring_capacity;
+	}
+	char *ring = realloc(reader->ring, size);
+	assert(ring);
+	reader->ring = ring;
+	reader->ring_size = size;
+}
+
+/* Append a fragment of a line, not including its newline */
+static void
+ring_append(struct details_reader *reader, const char *data, size_t len,
+		bool line_end)
+{
+	if (!reader->line_open) {
+		/* The entry of a line counts against the budget, bar the last */
+		while (reader->nr_tail_lines == reader->tail_lines
+				|| (reader->nr_tail_lines && tail_used(reader)
+					+ sizeof(*reader->lines)
+					> reader->ring_capacity)) {
+			drop_oldest_line(reader);
+		}
+		lines_reserve(reader);
+		size_t index = (reader->first_line + reader->nr_tail_lines)
+			% reader->lines_size;
+		reader->lines[index] = (struct details_tail_line){
+			.start = reader->ring_size ? (reader->ring_start
+				+ reader->ring_used) % reader->ring_size : 0,
+		};
+		reader->nr_tail_lines++;
+		reader->nr_seen++;
+		reader->line_open = true;
+	}
+	size_t last = (reader->first_line + reader->nr_tail_lines - 1)
+		% reader->lines_size;
+	struct details_tail_line *line = &reader->lines[last];
+	reader->line_open = !line_end;
+
+	/* Overlong lines are cut to what the budget leaves for them */
+	size_t room = reader->ring_capacity > sizeof(*line)
+		? reader->ring_capacity - sizeof(*line) : 0;
+	if (line->len + len > room) {
+		len = room > line->len ? room - line->len : 0;
+		line->truncated = true;
+	}
+	if (!len) {
+		return;
+	}
+
+	while (tail_used(reader) + len > reader->ring_capacity) {
+		drop_oldest_line(reader);
+	}
+	ring_reserve(reader, len);
+	if (line->len == 0) {
+		/* The ring may have been compacted or grown */
+		line->start = (reader->ring_start + reader->ring_used)
+			% reader->ring_size;
+	}
+
+	size_t pos = (reader->ring_start + reader->ring_used) % reader->ring_size;
+	size_t first = reader->ring_size - pos;
+	if (first > len) {
+		first = len;
+	}
+	memcpy(reader->ring + pos, data, first);
+	memcpy(reader->ring, data + first, len - first);
+	reader->ring_used += len;
+	line->len += len;
+}
+
+void
+details_reader_feed(struct details_reader *reader, const char *data,
+		size_t len)
+{
+	while (len > 0) {
+		if (!reader->head_done) {
+			size_t take = feed_head(reader, data, len);
+			data += take;
+			len -= take;
+			continue;
+		}
+		if (!reader->tail_lines) {
+			return;
+		}
+
+		const char *nl = memchr(data, '\n', len);
+		size_t fragment = nl ? (size_t)(nl - data) : len;
+		if (reader->skip_line) {
+			reader->skip_line = !nl;
+		} else {
+			ring_append(reader, data, fragment, nl != NULL);
+		}
+		if (nl) {
+			++fragment;
+		}
+		data += fragment;
+		len -= fragment;
+	}
+}
+
+ssize_t
+details_reader_read(struct details_reader *reader, int fd)
+{
+	char buf[DETAILS_READ_CHUNK];
+	ssize_t nread;
+	do {
+		nread = read(fd, buf, sizeof(buf));
+	} while (nread < 0 && errno == EINTR);
+	if (nread > 0) {
+		details_reader_feed(reader, buf, nread);
+	}
+	return nread;
+}
+
+bool
+details_reader_done(struct details_reader *reader)
+{
+	return reader->head_done && !reader->tail_lines;
+}
+
+void
+details_reader_drop_front(struct details_reader *reader, size_t len)
+{
+	assert(len <= reader->len);
+	memmove(reader->buffer, reader->buffer + len, reader->len - len);
+	reader->len -= len;
+}
+
+char *
+details_reader_finish(struct details_reader *reader, size_t *len)
+{
+	if (reader->head_cut) {
+		reader->len = utf8_trim_partial(reader->buffer, reader->len);
+	}
+
+	if (reader->nr_seen) {
+		if (reader->len && reader->buffer[reader->len - 1] != '\n') {
+			buffer_append(reader, "\n", 1);
+		}
+		size_t omitted = reader->nr_seen - reader->nr_tail_lines;
+		if (omitted) {
+			char marker[64];
+			int n = snprintf(marker, sizeof(marker),
+				"… %zu lines omitted …\n", omitted);
+			buffer_append(reader, marker, n);
+		}
+		for (size_t i = 0; i < reader->nr_tail_lines; i++) {
+			size_t index = (reader->first_line + i) % reader->lines_size;
+			struct details_tail_line *line = &reader->lines[index];
+			size_t start = reader->len;
+			size_t first = line->len;
+			if (line->start + first > reader->ring_size) {
+				first = reader->ring_size - line->start;
+			}
+			buffer_append(reader, reader->ring + line->start, first);
+			buffer_append(reader, reader->ring, line->len - first);
+			if (line->truncated) {
+				reader->len = start + utf8_trim_partial(
+					reader->buffer + start, line->len);
+			}
+			buffer_append(reader, "\n", 1);
+		}
+	}
+
+	/* Make sure there is a buffer to terminate, even for empty input */
+	if (!reader->buffer) {
+		reader->buffer = calloc(1, 1);
+		assert(reader->buffer);
+	}
+	while (reader->len && reader->buffer[reader->len - 1] == '\n') {
+		--reader->len;
+	}
+	reader->buffer[reader->len] = '\0';
+
+	char *text = reader->buffer;
+	*len = reader->len;
+	free(reader->ring);
+	free(reader->lines);
+	details_reader_init(reader, reader->max_bytes, reader->max_lines, 0);
+	return text;
+}
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef LAB_DETAILS_READER_H
+#define LAB_DETAILS_READER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DETAILS_MAX_BYTES (64 * 1024 * 1024)
+
+struct details_tail_line {
+	size_t start; /* offset into the ring */
+	size_t len;
+	bool truncated;
+};
+
+/*
+ * Streams a detailed message into memory. The first max_lines lines are kept
+ * (the head). If tail_lines is zero, anything after the head is ignored.
+ * Otherwise the last tail_lines lines are retained in a ring buffer of fixed
+ * capacity, so memory use is bounded no matter how much input arrives. The
+ * entries of the lines count against that capacity too.
+ */
+struct details_reader {
+	size_t max_bytes;
+	size_t max_lines;
+	size_t tail_lines;
+
+	char *buffer;
+	size_t len;
+	size_t size;
+	size_t nr_lines;
+	bool head_done;
+	bool head_cut; /* the head ends in a truncated line */
+	bool skip_line; /* discard input up to the next newline */
+
+	char *ring;
+	size_t ring_size;
+	size_t ring_capacity;
+	size_t ring_start;
+	size_t ring_used;
+	struct details_tail_line *lines;
+	size_t lines_size;
+	size_t first_line;
+	size_t nr_tail_lines;
+	bool line_open;
+	size_t nr_seen; /* lines which went to the tail, kept or not */
+};
+
+void details_reader_init(struct details_reader *reader, size_t max_bytes,
+		size_t max_lines, size_t tail_lines);
+
+/* Consume @len bytes of input */
+void details_reader_feed(struct details_reader *reader, const char *data,
+		size_t len);
+
+/*
+ * Read once from @fd and feed the data. Returns the number of bytes read, 0
+ * on EOF or -1 on error with errno set.
+ */
+ssize_t details_reader_read(struct details_reader *reader, int fd);
+
+/* Whether further input would be ignored */
+bool details_reader_done(struct details_reader *reader);
+
+/* Remove @len bytes from the start of the head */
+void details_reader_drop_front(struct details_reader *reader, size_t len);
+
+/*
+ * Returns the retained text, NUL-terminated and with trailing newlines
+ * removed. Ownership passes to the caller and the reader is reset.
+ */
+char *details_reader_finish(struct details_reader *reader, size_t *len);
+
+/*
+ * Returns the length of @buf limited to @max_bytes (without splitting a
+ * UTF-8 sequence) and @max_lines lines, with trailing newlines removed. A
+ * zero limit means no limit.
+ */
+size_t details_trim(const char *buf, size_t len, size_t max_bytes,
+		size_t max_lines);
+
+#endif /* LAB_DETAILS_READER_H */
@@ -0,0 +1,580 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <pango/pangocairo.h>
+#include <stdlib.h>
+#include <string.h>
+#include "details.h"
+
+/* Paragraphs either side of the viewport which keep their shaped layout */
+#define DETAILS_LAYOUT_MARGIN 8
+
+/* Unique across models, so the text of a new one never looks unchanged */
+static uint32_t
+next_revision(struct details_model *model)
+{
+	static uint32_t revision;
+	model->revision = ++revision;
+	return revision;
+}
+
+static void
+add_paragraph(struct details_model *model, size_t start, size_t len)
+{
+	if (model->nr_paragraphs == model->paragraphs_size) {
+		size_t size = model->paragraphs_size
+			? model->paragraphs_size * 2 : 64;
+		struct details_paragraph *paragraphs = realloc(model->paragraphs,
+			size * sizeof(*paragraphs));
+		assert(paragraphs);
+		model->paragraphs = paragraphs;
+		model->paragraphs_size = size;
+	}
+	model->paragraphs[model->nr_paragraphs++] = (struct details_paragraph){
+		.start = start,
+		.len = len,
+		.revision = next_revision(model),
+	};
+}
+
+/* Index the text from @start, which must be the start of a paragraph */
+static void
+index_paragraphs(struct details_model *model, size_t start)
+{
+	while (true) {
+		const char *nl = start < model->len
+			? memchr(model->text + start, '\n', model->len - start)
+			: NULL;
+		size_t end = nl ? (size_t)(nl - model->text) : model->len;
+		add_paragraph(model, start, end - start);
+		if (!nl) {
+			break;
+		}
+		start = end + 1;
+	}
+}
+
+void
+details_model_init(struct details_model *model, const char *text, size_t len)
+{
+	*model = (struct details_model){
+		.text = text,
+		.len = len,
+		.generation = 1,
+	};
+	index_paragraphs(model, 0);
+}
+
+static void
+drop_layout(struct details_paragraph *paragraph)
+{
+	if (paragraph->layout) {
+		g_object_unref(paragraph->layout);
+		paragraph->layout = NULL;
+	}
+}
+
+static void
+drop_extents(struct details_paragraph *paragraph)
+{
+	free(paragraph->line_heights);
+	paragraph->line_heights = NULL;
+	paragraph->generation = 0;
+}
+
+static void
+drop_all_layouts(struct details_model *model)
+{
+	for (size_t i = model->layout_start; i < model->layout_end; i++) {
+		drop_layout(&model->paragraphs[i]);
+	}
+	model->layout_start = 0;
+	model->layout_end = 0;
+}
+
+void
+details_model_finish(struct details_model *model)
+{
+	pango_font_description_free(model->font);
+	model->font = NULL;
+	if (!model->paragraphs) {
+		return;
+	}
+	drop_all_layouts(model);
+	for (size_t i = 0; i < model->nr_paragraphs; i++) {
+		drop_extents(&model->paragraphs[i]);
+	}
+	free(model->paragraphs);
+	model->paragraphs = NULL;
+	model->nr_paragraphs = 0;
+	model->paragraphs_size = 0;
+}
+
+void
+details_model_update(struct details_model *model, const char *text,
+		size_t len)
+{
+	struct details_paragraph *last =
+		&model->paragraphs[model->nr_paragraphs - 1];
+	assert(len >= last->start + last->len);
+
+	model->text = text;
+	model->len = len;
+
+	const char *nl = memchr(text + last->start, '\n', len - last->start);
+	size_t end = nl ? (size_t)(nl - text) : len;
+	if (end - last->start != last->len) {
+		/* The last line was still being written */
+		drop_layout(last);
+		drop_extents(last);
+		last->len = end - last->start;
+		last->revision = next_revision(model);
+	}
+	if (nl) {
+		index_paragraphs(model, end + 1);
+	}
+}
+
+void
+details_model_drop_front(struct details_model *model, size_t count,
+		const char *text, size_t len)
+{
+	assert(count < model->nr_paragraphs);
+	size_t bytes = model->paragraphs[count].start;
+
+	size_t end = model->layout_end < count ? model->layout_end : count;
+	for (size_t i = model->layout_start; i < end; i++) {
+		drop_layout(&model->paragraphs[i]);
+	}
+	if (model->layout_end <= count) {
+		model->layout_start = 0;
+		model->layout_end = 0;
+	} else {
+		model->layout_start = model->layout_start > count
+			? model->layout_start - count : 0;
+		model->layout_end -= count;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		drop_extents(&model->paragraphs[i]);
+	}
+	model->nr_paragraphs -= count;
+	memmove(model->paragraphs, model->paragraphs + count,
+		model->nr_paragraphs * sizeof(*model->paragraphs));
+	for (size_t i = 0; i < model->nr_paragraphs; i++) {
+		model->paragraphs[i].start -= bytes;
+	}
+	model->text = text;
+	model->len = len;
+	if (count) {
+		model->drops++;
+	}
+}
+
+void
+details_model_drop_bytes(struct details_model *model, size_t bytes,
+		const char *text, size_t len)
+{
+	size_t count = 0;
+	while (count + 1 < model->nr_paragraphs
+			&& model->paragraphs[count + 1].start <= bytes) {
+		++count;
+	}
+	struct details_paragraph *first = &model->paragraphs[count];
+	size_t cut = bytes - first->start;
+	assert(cut <= first->len);
+
+	details_model_drop_front(model, count, text, len);
+	if (cut) {
+		/* What is left of the paragraph is shaped again */
+		first = &model->paragraphs[0];
+		drop_layout(first);
+		drop_extents(first);
+		first->len -= cut;
+		first->revision = next_revision(model);
+		model->drops++;
+		for (size_t i = 1; i < model->nr_paragraphs; i++) {
+			model->paragraphs[i].start -= cut;
+		}
+	}
+}
+
+size_t
+details_model_first_change(const struct details_model *model,
+		uint32_t revision)
+{
+	size_t i = model->nr_paragraphs;
+	while (i > 0 && model->paragraphs[i - 1].revision > revision) {
+		--i;
+	}
+	return i;
+}
+
+void
+details_model_configure(struct details_model *model, PangoContext *context,
+		const PangoFontDescription *font, int width)
+{
+	/* A copy, as another description may later be at the same address */
+	bool same_font = model->font
+		&& pango_font_description_equal(font, model->font);
+	unsigned int serial = pango_context_get_serial(context);
+	if (context == model->context && same_font
+			&& width == model->width
+			&& serial == model->context_serial) {
+		return;
+	}
+
+	if (context != model->context || !same_font) {
+		drop_all_layouts(model);
+	} else {
+		for (size_t i = model->layout_start; i < model->layout_end; i++) {
+			if (model->paragraphs[i].layout) {
+				pango_layout_set_width(model->paragraphs[i].layout,
+					width);
+			}
+		}
+	}
+
+	model->context = context;
+	if (!same_font) {
+		pango_font_description_free(model->font);
+		model->font = pango_font_description_copy(font);
+	}
+	model->width = width;
+	model->context_serial = serial;
+	model->generation++;
+}
+
+static PangoLayout *
+get_layout(struct details_model *model, size_t index)
+{
+	struct details_paragraph *paragraph = &model->paragraphs[index];
+	if (paragraph->layout) {
+		return paragraph->layout;
+	}
+
+	PangoLayout *layout = pango_layout_new(model->context);
+	pango_layout_set_font_description(layout, model->font);
+	pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
+	pango_layout_set_width(layout, model->width);
+	pango_layout_set_text(layout, model->text + paragraph->start,
+		paragraph->len);
+	paragraph->layout = layout;
+
+	if (model->layout_start == model->layout_end) {
+		model->layout_start = index;
+		model->layout_end = index + 1;
+	} else if (index < model->layout_start) {
+		model->layout_start = index;
+	} else if (index >= model->layout_end) {
+		model->layout_end = index + 1;
+	}
+	return layout;
+}
+
+/* Returns the paragraph with its line count and heights up to date */
+static const struct details_paragraph *
+get_extents(struct details_model *model, size_t index)
+{
+	struct details_paragraph *paragraph = &model->paragraphs[index];
+	if (paragraph->generation == model->generation) {
+		return paragraph;
+	}
+
+	PangoLayout *layout = get_layout(model, index);
+	int nr_lines = pango_layout_get_line_count(layout);
+	free(paragraph->line_heights);
+	paragraph->line_heights = NULL;
+	if (nr_lines > 1) {
+		paragraph->line_heights =
+			calloc(nr_lines, sizeof(*paragraph->line_heights));
+		assert(paragraph->line_heights);
+	}
+
+	int height = 0;
+	PangoLayoutIter *iter = pango_layout_get_iter(layout);
+	int line = 0;
+	do {
+		int y0, y1;
+		pango_layout_iter_get_line_yrange(iter, &y0, &y1);
+		if (paragraph->line_heights) {
+			paragraph->line_heights[line] = y1 - y0;
+		}
+		height += y1 - y0;
+	} while (++line < nr_lines && pango_layout_iter_next_line(iter));
+	pango_layout_iter_free(iter);
+
+	paragraph->nr_lines = nr_lines;
+	paragraph->height = height;
+	paragraph->generation = model->generation;
+	return paragraph;
+}
+
+static int
+line_height(const struct details_paragraph *paragraph, int line)
+{
+	return paragraph->line_heights
+		? paragraph->line_heights[line] : paragraph->height;
+}
+
+int
+details_model_get_lines(struct details_model *model, size_t index)
+{
+	return get_extents(model, index)->nr_lines;
+}
+
+int
+details_model_scroll(struct details_model *model, struct details_pos *pos,
+		int delta)
+{
+	if (pos->paragraph >= model->nr_paragraphs) {
+		pos->paragraph = model->nr_paragraphs - 1;
+	}
+	int lines = details_model_get_lines(model, pos->paragraph);
+	if (pos->line >= lines) {
+		/* The paragraph was re-wrapped to fewer lines */
+		pos->line = lines - 1;
+	}
+
+	int moved = 0;
+	while (delta > 0) {
+		if (pos->line + 1 < details_model_get_lines(model, pos->paragraph)) {
+			pos->line++;
+		} else if (pos->paragraph + 1 < model->nr_paragraphs) {
+			pos->paragraph++;
+			pos->line = 0;
+		} else {
+			break;
+		}
+		--delta;
+		++moved;
+	}
+	while (delta < 0) {
+		if (pos->line > 0) {
+			pos->line--;
+		} else if (pos->paragraph > 0) {
+			pos->paragraph--;
+			pos->line = details_model_get_lines(model, pos->paragraph) - 1;
+		} else {
+			break;
+		}
+		++delta;
+		--moved;
+	}
+	return moved;
+}
+
+int
+details_model_measure(struct details_model *model,
+		const struct details_pos *pos, int max_height, int *height,
+		size_t *last, bool *more)
+{
+	int nr_lines = 0;
+	int total = 0;
+	int skip = pos->line;
+
+	*more = false;
+	*last = pos->paragraph;
+	for (size_t i = pos->paragraph; i < model->nr_paragraphs; i++) {
+		const struct details_paragraph *paragraph = get_extents(model, i);
+		for (int line = skip; line < paragraph->nr_lines; line++) {
+			int extent = line_height(paragraph, line);
+			if (nr_lines > 0 && PANGO_PIXELS_CEIL(total + extent)
+					> max_height) {
+				*more = true;
+				break;
+			}
+			total += extent;
+			++nr_lines;
+		}
+
+		*last = i;
+		if (*more) {
+			break;
+		}
+		skip = 0;
+	}
+
+	*height = PANGO_PIXELS_CEIL(total);
+	return nr_lines;
+}
+
+int
+details_model_distance(struct details_model *model,
+		const struct details_pos *from, const struct details_pos *to,
+		int max_lines)
+{
+	struct details_pos pos = *from;
+	for (int i = 0; i <= max_lines; i++) {
+		if (pos.paragraph == to->paragraph && pos.line == to->line) {
+			return i;
+		}
+		if (details_model_scroll(model, &pos, 1) != 1) {
+			break;
+		}
+	}
+	return -1;
+}
+
+int
+details_model_span(struct details_model *model, const struct details_pos *pos,
+		int nr_lines)
+{
+	int total = 0;
+	int skip = pos->line;
+
+	for (size_t i = pos->paragraph;
+			i < model->nr_paragraphs && nr_lines > 0; i++) {
+		const struct details_paragraph *paragraph = get_extents(model, i);
+		if (skip == 0 && nr_lines >= paragraph->nr_lines) {
+			total += paragraph->height;
+			nr_lines -= paragraph->nr_lines;
+			continue;
+		}
+		for (int line = skip;
+				line < paragraph->nr_lines && nr_lines > 0; line++) {
+			total += line_height(paragraph, line);
+			--nr_lines;
+		}
+		skip = 0;
+	}
+	return total;
+}
+
+static int
+pos_cmp(const struct details_pos *a, const struct details_pos *b)
+{
+	if (a->paragraph != b->paragraph) {
+		return a->paragraph < b->paragraph ? -1 : 1;
+	}
+	return a->line < b->line ? -1 : a->line > b->line;
+}
+
+int
+details_model_scroll_by(struct details_model *model, struct details_pos *pos,
+		int *offset, int delta, const struct details_pos *end)
+{
+	if (pos_cmp(pos, end) >= 0) {
+		*pos = *end;
+		*offset = 0;
+	} else if (*offset >= details_model_span(model, pos, 1)) {
+		*offset = 0;
+	}
+
+	int moved = 0;
+	while (delta > 0) {
+		if (pos_cmp(pos, end) >= 0) {
+			break;
+		}
+		int room = details_model_span(model, pos, 1) - *offset;
+		if (delta < room) {
+			*offset += delta;
+			moved += delta;
+			break;
+		}
+		details_model_scroll(model, pos, 1);
+		*offset = 0;
+		moved += room;
+		delta -= room;
+	}
+	while (delta < 0) {
+		if (*offset == 0) {
+			if (details_model_scroll(model, pos, -1) == 0) {
+				break;
+			}
+			*offset = details_model_span(model, pos, 1);
+		}
+		int step = -delta < *offset ? -delta : *offset;
+		*offset -= step;
+		moved -= step;
+		delta += step;
+	}
+	return moved;
+}
+
+void
+details_model_scroll_to_end(struct details_model *model,
+		struct details_pos *pos, int max_height)
+{
+	int total = 0;
+	for (size_t i = model->nr_paragraphs; i-- > 0;) {
+		const struct details_paragraph *paragraph = get_extents(model, i);
+		int nr_lines = paragraph->nr_lines;
+		for (int line = nr_lines - 1; line >= 0; line--) {
+			int height = line_height(paragraph, line);
+			if (total > 0 && PANGO_PIXELS_CEIL(total + height)
+					> max_height) {
+				*pos = (struct details_pos){ i, line + 1 };
+				if (pos->line == nr_lines) {
+					*pos = (struct details_pos){ i + 1, 0 };
+				}
+				return;
+			}
+			total += height;
+		}
+	}
+	*pos = (struct details_pos){ 0, 0 };
+}
+
+void
+details_model_draw(struct details_model *model, cairo_t *cairo,
+		const struct details_pos *pos, int nr_lines, double x, double y)
+{
+	int offset = 0;
+	int skip = pos->line;
+
+	for (size_t i = pos->paragraph;
+			i < model->nr_paragraphs && nr_lines > 0; i++) {
+		PangoLayoutIter *iter = pango_layout_get_iter(get_layout(model, i));
+		int line = 0;
+		do {
+			if (line++ < skip) {
+				continue;
+			}
+			int y0, y1;
+			PangoRectangle logical;
+			pango_layout_iter_get_line_yrange(iter, &y0, &y1);
+			pango_layout_iter_get_line_extents(iter, NULL, &logical);
+			int baseline = pango_layout_iter_get_baseline(iter);
+
+			cairo_move_to(cairo,
+				x + (double)logical.x / PANGO_SCALE,
+				y + (double)(offset + baseline - y0) / PANGO_SCALE);
+			pango_cairo_show_layout_line(cairo,
+				pango_layout_iter_get_line_readonly(iter));
+
+			offset += y1 - y0;
+			--nr_lines;
+		} while (nr_lines > 0 && pango_layout_iter_next_line(iter));
+		pango_layout_iter_free(iter);
+		skip = 0;
+	}
+}
+
+void
+details_model_release_layouts(struct details_model *model, size_t first,
+		size_t last)
+{
+	size_t keep_start = first > DETAILS_LAYOUT_MARGIN
+		? first - DETAILS_LAYOUT_MARGIN : 0;
+	size_t keep_end = last + DETAILS_LAYOUT_MARGIN + 1;
+
+	for (size_t i = model->layout_start; i < model->layout_end; i++) {
+		if (i < keep_start || i >= keep_end) {
+			drop_layout(&model->paragraphs[i]);
+		}
+	}
+
+	if (keep_start < model->layout_start) {
+		keep_start = model->layout_start;
+	}
+	if (keep_end > model->layout_end) {
+		keep_end = model->layout_end;
+	}
+	if (keep_start >= keep_end) {
+		keep_start = 0;
+		keep_end = 0;
+	}
+	model->layout_start = keep_start;
+	model->layout_end = keep_end;
+}
@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef LAB_DETAILS_H
+#define LAB_DETAILS_H
+#include <pango/pangocairo.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The detailed message is split into paragraphs (one per input line) which
+ * are only shaped when they come close to the viewport. Wrapped line counts
+ * and heights are computed lazily and cached until the wrap width or the
+ * pango context changes, so the per-frame cost does not depend on the size
+ * of the input, and measuring needs no layout once a paragraph was shaped.
+ */
+
+struct details_paragraph {
+	size_t start;
+	size_t len;
+	uint32_t revision; /* of the model when the text last changed */
+
+	/* Valid if generation is equal to the model generation */
+	uint32_t generation;
+	int nr_lines;
+	int height; /* of all wrapped lines, in pango units */
+	int *line_heights; /* per wrapped line, NULL if there is only one */
+
+	PangoLayout *layout;
+};
+
+/* A scroll position: the first visible wrapped line of a paragraph */
+struct details_pos {
+	size_t paragraph;
+	int line;
+};
+
+struct details_model {
+	const char *text;
+	size_t len;
+
+	struct details_paragraph *paragraphs;
+	size_t nr_paragraphs;
+	size_t paragraphs_size;
+
+	PangoContext *context;
+	PangoFontDescription *font; /* a copy */
+	int width; /* wrap width in pango units */
+	unsigned int context_serial;
+	uint32_t generation;
+	uint32_t revision; /* bumped whenever the text of a paragraph changes */
+	uint32_t drops; /* bumped whenever text is dropped from the front */
+
+	/* Only paragraphs in [layout_start, layout_end) may hold a layout */
+	size_t layout_start;
+	size_t layout_end;
+};
+
+/* Index @text, which must outlive the model */
+void details_model_init(struct details_model *model, const char *text,
+		size_t len);
+void details_model_finish(struct details_model *model);
+
+/*
+ * Index text appended since the last call. @text may have moved but must
+ * start with the previously indexed text. Only the last paragraph and the
+ * new ones are re-shaped.
+ */
+void details_model_update(struct details_model *model, const char *text,
+		size_t len);
+
+/*
+ * Forget the first @count paragraphs. @text is what remains once their
+ * bytes were removed from the front.
+ */
+void details_model_drop_front(struct details_model *model, size_t count,
+		const char *text, size_t len);
+
+/*
+ * Forget the first @bytes of the text, which may end within a paragraph.
+ * What is left of that one is shaped again.
+ */
+void details_model_drop_bytes(struct details_model *model, size_t bytes,
+		const char *text, size_t len);
+
+/*
+ * Returns the first paragraph whose text changed since the model was at
+ * @revision, or the number of paragraphs. Without a drop in between, only
+ * the last ones can have changed.
+ */
+size_t details_model_first_change(const struct details_model *model,
+		uint32_t revision);
+
+/* Set the shaping parameters; invalidates cached line counts on change */
+void details_model_configure(struct details_model *model,
+		PangoContext *context, const PangoFontDescription *font, int width);
+
+int details_model_get_lines(struct details_model *model, size_t index);
+
+/*
+ * Move @pos by @delta wrapped lines, stopping at the start and the end of the
+ * text. Returns the number of lines actually moved.
+ */
+int details_model_scroll(struct details_model *model, struct details_pos *pos,
+		int delta);
+
+/*
+ * Count the whole wrapped lines from @pos which fit in @max_height pixels.
+ * At least one line is always counted. @height is set to their combined
+ * height in pixels, @last to the last paragraph touched and @more to whether
+ * any text remains below them.
+ */
+int details_model_measure(struct details_model *model,
+		const struct details_pos *pos, int max_height, int *height,
+		size_t *last, bool *more);
+
+/*
+ * Returns how many wrapped lines @to is below @from, or -1 if it is not
+ * within @max_lines of it.
+ */
+int details_model_distance(struct details_model *model,
+		const struct details_pos *from, const struct details_pos *to,
+		int max_lines);
+
+/* Returns the height of @nr_lines wrapped lines from @pos in pango units */
+int details_model_span(struct details_model *model,
+		const struct details_pos *pos, int nr_lines);
+
+/*
+ * Move @pos by @delta pango units, with @offset the units already scrolled
+ * into its first line. Stops at the start of the text and at @end, where
+ * @offset is zero. A position past @end or an offset past the end of its
+ * line, e.g. after re-wrapping, is clamped first. Returns the number of
+ * units moved, not counting the clamping.
+ */
+int details_model_scroll_by(struct details_model *model,
+		struct details_pos *pos, int *offset, int delta,
+		const struct details_pos *end);
+
+/* Set @pos so that the last wrapped lines fill @max_height pixels */
+void details_model_scroll_to_end(struct details_model *model,
+		struct details_pos *pos, int max_height);
+
+/* Draw @nr_lines wrapped lines from @pos with their top-left at @x, @y */
+void details_model_draw(struct details_model *model, cairo_t *cairo,
+		const struct details_pos *pos, int nr_lines, double x, double y);
+
+/*
+ * Drop the layouts of paragraphs further than DETAILS_LAYOUT_MARGIN away
+ * from the visible paragraphs [@first, @last].
+ */
+void details_model_release_layouts(struct details_model *model, size_t first,
+		size_t last);
+
+#endif /* LAB_DETAILS_H */
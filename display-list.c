@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "display-list.h"
+
+void
+display_list_reset(struct display_list *list, double scale)
+{
+	list->nr_items = 0;
+	list->area = (struct display_rect){ 0 };
+	list->scale = scale;
+}
+
+static void
+reserve(struct display_list *list, size_t nr_items)
+{
+	if (nr_items <= list->size) {
+		return;
+	}
+	size_t size = list->size ? list->size : 16;
+	while (size < nr_items) {
+		size *= 2;
+	}
+	struct display_item *items = realloc(list->items, size * sizeof(*items));
+	assert(items);
+	list->items = items;
+	list->size = size;
+}
+
+struct display_item *
+display_list_add(struct display_list *list, enum display_item_type type,
+		int x, int y, int width, int height, uint32_t color)
+{
+	reserve(list, list->nr_items + 1);
+	struct display_item *item = &list->items[list->nr_items++];
+	*item = (struct display_item){
+		.type = type,
+		.box = { x, y, width, height },
+		.color = color,
+	};
+	return item;
+}
+
+void
+display_list_copy(struct display_list *dst, const struct display_list *src)
+{
+	reserve(dst, src->nr_items);
+	memcpy(dst->items, src->items, src->nr_items * sizeof(*src->items));
+	dst->nr_items = src->nr_items;
+	dst->area = src->area;
+	dst->scale = src->scale;
+}
+
+void
+display_list_finish(struct display_list *list)
+{
+	free(list->items);
+	*list = (struct display_list){ 0 };
+}
+
+static bool
+rect_equal(struct display_rect a, struct display_rect b)
+{
+	return a.x == b.x && a.y == b.y
+		&& a.width == b.width && a.height == b.height;
+}
+
+static bool
+rect_empty(struct display_rect r)
+{
+	return r.width <= 0 || r.height <= 0;
+}
+
+static bool
+item_equal(const struct display_item *a, const struct display_item *b)
+{
+	return a->type == b->type
+		&& a->box.x == b->box.x && a->box.y == b->box.y
+		&& a->box.width == b->box.width
+		&& a->box.height == b->box.height
+		&& a->x == b->x && a->y == b->y
+		&& a->color == b->color
+		&& a->markup == b->markup
+		&& a->key == b->key;
+}
+
+static bool
+list_contains(const struct display_list *list, const struct display_item *item)
+{
+	for (size_t i = 0; i < list->nr_items; i++) {
+		if (item_equal(&list->items[i], item)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Whether @a is @b with its right edge moved, e.g. a progress bar. Being
+ * solid, only the span between the two edges changes.
+ */
+static bool
+item_resized(const struct display_item *a, const struct display_item *b)
+{
+	return (a->type == DISPLAY_FILL || a->type == DISPLAY_RECT)
+		&& a->type == b->type
+		&& a->box.x == b->box.x && a->box.y == b->box.y
+		&& a->box.width != b->box.width
+		&& a->box.height == b->box.height
+		&& a->color == b->color
+		&& a->key == b->key;
+}
+
+static const struct display_item *
+list_find_resized(const struct display_list *list,
+		const struct display_item *item)
+{
+	for (size_t i = 0; i < list->nr_items; i++) {
+		if (item_resized(&list->items[i], item)) {
+			return &list->items[i];
+		}
+	}
+	return NULL;
+}
+
+static struct display_rect
+rect_union(struct display_rect a, struct display_rect b)
+{
+	int x1 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+	int y1 = a.y + a.height > b.y + b.height
+		? a.y + a.height : b.y + b.height;
+	int x0 = a.x < b.x ? a.x : b.x;
+	int y0 = a.y < b.y ? a.y : b.y;
+	return (struct display_rect){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+static bool
+rect_touches(struct display_rect a, struct display_rect b)
+{
+	return a.x <= b.x + b.width && b.x <= a.x + a.width
+		&& a.y <= b.y + b.height && b.y <= a.y + a.height;
+}
+
+static struct display_rect
+rect_intersect(struct display_rect a, struct display_rect b)
+{
+	int x0 = a.x > b.x ? a.x : b.x;
+	int y0 = a.y > b.y ? a.y : b.y;
+	int x1 = a.x + a.width < b.x + b.width ? a.x + a.width : b.x + b.width;
+	int y1 = a.y + a.height < b.y + b.height
+		? a.y + a.height : b.y + b.height;
+	return (struct display_rect){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+static long
+rect_area(struct display_rect r)
+{
+	return (long)r.width * r.height;
+}
+
+void
+display_damage_add(struct display_damage *damage, struct display_rect rect,
+		const struct display_list *list)
+{
+	rect = rect_intersect(rect, list->area);
+	if (rect_empty(rect)) {
+		return;
+	}
+
+	for (int i = 0; i < damage->nr_rects; i++) {
+		if (rect_touches(damage->rects[i], rect)) {
+			damage->rects[i] = rect_union(damage->rects[i], rect);
+			return;
+		}
+	}
+	if (damage->nr_rects < DISPLAY_MAX_DAMAGE) {
+		damage->rects[damage->nr_rects++] = rect;
+		return;
+	}
+
+	/* Out of rectangles, so grow the one which grows the least */
+	int best = 0;
+	long best_growth = -1;
+	for (int i = 0; i < damage->nr_rects; i++) {
+		struct display_rect u = rect_union(damage->rects[i], rect);
+		long growth = rect_area(u) - rect_area(damage->rects[i]);
+		if (best_growth < 0 || growth < best_growth) {
+			best = i;
+			best_growth = growth;
+		}
+	}
+	damage->rects[best] = rect_union(damage->rects[best], rect);
+}
+
+bool
+display_list_diff(const struct display_list *list,
+		const struct display_list *old, struct display_damage *damage)
+{
+	damage->nr_rects = 0;
+
+	if (!rect_equal(list->area, old->area) || list->scale != old->scale) {
+		display_damage_add(damage, list->area, list);
+		return true;
+	}
+
+	bool differ = false;
+	for (size_t i = 0; i < list->nr_items; i++) {
+		const struct display_item *item = &list->items[i];
+		if (list_contains(old, item)) {
+			continue;
+		}
+		struct display_rect box = item->box;
+		const struct display_item *resized =
+			list_find_resized(old, item);
+		if (resized) {
+			int narrow = box.width < resized->box.width
+				? box.width : resized->box.width;
+			box.x += narrow;
+			box.width = abs(box.width - resized->box.width);
+		}
+		display_damage_add(damage, box, list);
+		differ = true;
+	}
+	for (size_t i = 0; i < old->nr_items; i++) {
+		const struct display_item *item = &old->items[i];
+		if (list_contains(list, item)) {
+			continue;
+		}
+		/* Damaged along with what it became */
+		if (!list_find_resized(list, item)) {
+			display_damage_add(damage, item->box, list);
+		}
+		differ = true;
+	}
+	return differ;
+}
+
+const struct display_item *
+display_list_find_change(const struct display_list *list,
+		const struct display_list *old, const struct display_item **old_item)
+{
+	if (!rect_equal(list->area, old->area) || list->scale != old->scale
+			|| list->nr_items != old->nr_items) {
+		return NULL;
+	}
+
+	const struct display_item *changed = NULL;
+	for (size_t i = 0; i < list->nr_items; i++) {
+		const struct display_item *a = &list->items[i];
+		const struct display_item *b = &old->items[i];
+		if (item_equal(a, b)) {
+			continue;
+		}
+		if (changed || a->type != b->type
+				|| a->box.x != b->box.x || a->box.y != b->box.y
+				|| a->box.width != b->box.width
+				|| a->box.height != b->box.height
+				|| a->x != b->x || a->y != b->y
+				|| a->color != b->color) {
+			return NULL;
+		}
+		changed = a;
+		*old_item = b;
+	}
+	return changed;
+}
+
+void
+display_list_fit(struct display_list *list, struct display_rect clip)
+{
+	struct display_rect bounds = { 0 };
+	for (size_t i = 0; i < list->nr_items; i++) {
+		struct display_rect box = list->items[i].box;
+		if (rect_empty(box)) {
+			continue;
+		}
+		bounds = rect_empty(bounds) ? box : rect_union(bounds, box);
+	}
+	bounds = rect_intersect(bounds, clip);
+	list->area = rect_empty(bounds) ? (struct display_rect){ 0 } : bounds;
+}
+
+struct display_rect
+display_list_pixels(const struct display_list *list, struct display_rect rect)
+{
+	double scale = list->scale;
+	rect.x -= list->area.x;
+	rect.y -= list->area.y;
+	int x0 = floor(rect.x * scale);
+	int y0 = floor(rect.y * scale);
+	int x1 = ceil((rect.x + rect.width) * scale);
+	int y1 = ceil((rect.y + rect.height) * scale);
+	return (struct display_rect){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+uint64_t
+display_hash(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
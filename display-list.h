@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef LAB_DISPLAY_LIST_H
+#define LAB_DISPLAY_LIST_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A frame is described as a list of drawing operations before anything is
+ * rasterized. Comparing the list with the one a buffer was last drawn from
+ * gives the areas which actually need repainting, and comparing it with the
+ * previously committed one gives the damage to report to the compositor.
+ */
+
+#define DISPLAY_MAX_DAMAGE 8
+#define DISPLAY_HASH_INIT 0xcbf29ce484222325ULL
+
+enum display_item_type {
+	DISPLAY_FILL, /* replaces the pixels under it */
+	DISPLAY_RECT,
+	DISPLAY_TEXT,
+	DISPLAY_DETAILS,
+};
+
+struct display_rect {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+/*
+ * Items are compared by value, so @key must identify what is drawn, e.g. a
+ * hash of the text. @data is only valid while the list is being drawn.
+ */
+struct display_item {
+	enum display_item_type type;
+	struct display_rect box; /* every pixel the item may touch */
+	int x; /* text origin */
+	int y;
+	uint32_t color;
+	bool markup;
+	uint64_t key;
+	const void *data;
+
+	/* Scrolled content, e.g. the details lines */
+	struct {
+		uint64_t content; /* what the positions refer to, e.g. wrapping */
+		uint32_t revision; /* of the content when drawn */
+		size_t paragraph;
+		size_t last; /* the last paragraph drawn */
+		int line;
+		int offset;
+		int nr_lines;
+	} scroll;
+};
+
+struct display_list {
+	struct display_item *items;
+	size_t nr_items;
+	size_t size;
+
+	/* The part of the bar the list is drawn to, and the scale */
+	struct display_rect area;
+	double scale;
+};
+
+struct display_damage {
+	struct display_rect rects[DISPLAY_MAX_DAMAGE];
+	int nr_rects;
+};
+
+/* Empty @list and set the scale it is going to be drawn at */
+void display_list_reset(struct display_list *list, double scale);
+
+/* Set the area of @list to the bounding box of its items, within @clip */
+void display_list_fit(struct display_list *list, struct display_rect clip);
+
+struct display_item *display_list_add(struct display_list *list,
+		enum display_item_type type, int x, int y, int width, int height,
+		uint32_t color);
+
+void display_list_copy(struct display_list *dst,
+		const struct display_list *src);
+
+void display_list_finish(struct display_list *list);
+
+/*
+ * Set @damage to the areas where @list and @old differ, or to the whole
+ * area if @old was drawn to another area or at another scale. A solid item
+ * which only got wider or narrower damages just the span between its right
+ * edges. Rectangles are merged once there are more than DISPLAY_MAX_DAMAGE
+ * of them. Returns
+ * whether the lists differ at all, which may be true with empty @damage if
+ * the area moved or became empty.
+ */
+bool display_list_diff(const struct display_list *list,
+		const struct display_list *old, struct display_damage *damage);
+
+/*
+ * If @list differs from @old in a single item, and only in what it shows,
+ * return it and set @old_item to its predecessor. Otherwise return NULL.
+ */
+const struct display_item *display_list_find_change(
+		const struct display_list *list, const struct display_list *old,
+		const struct display_item **old_item);
+
+/* Add @rect, clamped to the area of @list, to @damage */
+void display_damage_add(struct display_damage *damage,
+		struct display_rect rect, const struct display_list *list);
+
+/*
+ * Returns the buffer pixels covered by @rect, given in bar coordinates, when
+ * drawing @list. They are rounded outwards so that nothing inside @rect is
+ * left partially covered.
+ */
+struct display_rect display_list_pixels(const struct display_list *list,
+		struct display_rect rect);
+
+/* FNV-1a, chained by passing the previous result as @hash */
+uint64_t display_hash(uint64_t hash, const void *data, size_t len);
+
+#endif /* LAB_DISPLAY_LIST_H */
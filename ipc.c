@@ -0,0 +1,385 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _GNU_SOURCE /* accept4(), MSG_CMSG_CLOEXEC */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+#include "ipc.h"
+
+/* How long a client may take to send its request */
+#define IPC_TIMEOUT_MS 1000
+
+static bool
+socket_address(struct sockaddr_un *addr, const char *tag)
+{
+	/* Kept within the runtime dir, which only the user has access to */
+	if (tag && strchr(tag, '/')) {
+		return false;
+	}
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	if (!dir || !*dir) {
+		return false;
+	}
+	const char *display = getenv("WAYLAND_DISPLAY");
+	if (!display || !*display) {
+		display = "wayland-0";
+	}
+	/* It may also be an absolute path */
+	const char *slash = strrchr(display, '/');
+	if (slash) {
+		display = slash + 1;
+	}
+	*addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+	int len = snprintf(addr->sun_path, sizeof(addr->sun_path),
+		"%s/labnag-%s%s%s.sock", dir, display, tag ? "-" : "",
+		tag ? tag : "");
+	return len > 0 && (size_t)len < sizeof(addr->sun_path);
+}
+
+static bool
+send_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	while (len) {
+		ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		} else if (sent <= 0) {
+			return false;
+		}
+		p += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+static bool
+recv_all(int fd, void *data, size_t len)
+{
+	char *p = data;
+	while (len) {
+		ssize_t nread = recv(fd, p, len, 0);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		} else if (nread <= 0) {
+			return false;
+		}
+		p += nread;
+		len -= nread;
+	}
+	return true;
+}
+
+/* Keep the first fd passed along with @msg in @fd, and close any others */
+static void
+receive_fds(struct msghdr *msg, int *fd)
+{
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg;
+			cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+				|| cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		size_t nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < nr_fds; i++) {
+			int received;
+			memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int),
+				sizeof(int));
+			if (*fd < 0) {
+				*fd = received;
+			} else {
+				close(received);
+			}
+		}
+	}
+}
+
+int
+ipc_connect(const char *tag)
+{
+	struct sockaddr_un addr;
+	if (!socket_address(&addr, tag)) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int
+ipc_listen(const char *tag)
+{
+	struct sockaddr_un addr;
+	if (!socket_address(&addr, tag)) {
+		wlr_log(WLR_ERROR, "Unable to name the socket, "
+			"is XDG_RUNTIME_DIR set?");
+		return -1;
+	}
+
+	/* A socket nobody answers on is left over from one which died */
+	int fd = ipc_connect(tag);
+	if (fd >= 0) {
+		wlr_log(WLR_DEBUG, "%s is in use", addr.sun_path);
+		close(fd);
+		return -1;
+	}
+	unlink(addr.sun_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		wlr_log_errno(WLR_ERROR, "Unable to create socket");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| listen(fd, SOMAXCONN) < 0) {
+		wlr_log_errno(WLR_ERROR, "Unable to listen on %s",
+			addr.sun_path);
+		close(fd);
+		return -1;
+	}
+	/* Pending connections are accepted until there are none left */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	wlr_log(WLR_DEBUG, "Listening on %s", addr.sun_path);
+	return fd;
+}
+
+void
+ipc_close(int fd, const char *tag)
+{
+	struct sockaddr_un addr;
+	if (socket_address(&addr, tag)) {
+		unlink(addr.sun_path);
+	}
+	close(fd);
+}
+
+int
+ipc_accept(int listen_fd)
+{
+	/* Requests are read as they come in, see ipc_reader_read() */
+	return accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+}
+
+bool
+ipc_send_request(int fd, int argc, char **argv)
+{
+	char *cwd = getcwd(NULL, 0);
+	size_t cwd_len = cwd ? strlen(cwd) + 1 : 1;
+	size_t size = cwd_len;
+	for (int i = 1; i < argc; i++) {
+		size += strlen(argv[i]) + 1;
+	}
+	if (size > IPC_MAX_REQUEST) {
+		free(cwd);
+		return false;
+	}
+
+	char *payload = malloc(size);
+	if (!payload) {
+		free(cwd);
+		return false;
+	}
+	char *p = payload;
+	memcpy(p, cwd ? cwd : "", cwd_len);
+	p += cwd_len;
+	for (int i = 1; i < argc; i++) {
+		size_t len = strlen(argv[i]) + 1;
+		memcpy(p, argv[i], len);
+		p += len;
+	}
+	free(cwd);
+
+	uint32_t header = size;
+	struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control = { 0 };
+	if (fcntl(STDIN_FILENO, F_GETFD) != -1) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		int stdin_fd = STDIN_FILENO;
+		memcpy(CMSG_DATA(cmsg), &stdin_fd, sizeof(stdin_fd));
+	}
+
+	bool ok = sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(header)
+		&& send_all(fd, payload, size);
+	free(payload);
+	return ok;
+}
+
+static int64_t
+now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void
+ipc_reader_init(struct ipc_reader *reader)
+{
+	*reader = (struct ipc_reader){
+		.deadline = now_ms() + IPC_TIMEOUT_MS,
+		.request.stdin_fd = -1,
+	};
+}
+
+int
+ipc_reader_timeout(const struct ipc_reader *reader)
+{
+	int64_t left = reader->deadline - now_ms();
+	return left > 0 ? left : 0;
+}
+
+/* Split the payload into the working directory and the arguments */
+static bool
+parse_request(struct ipc_request *request)
+{
+	if (request->buffer[request->size - 1] != '\0') {
+		return false;
+	}
+	request->cwd = request->buffer;
+	request->argc = 1;
+	for (size_t i = strlen(request->cwd) + 1; i < request->size;
+			i += strlen(request->buffer + i) + 1) {
+		++request->argc;
+	}
+	request->argv = calloc(request->argc + 1, sizeof(char *));
+	if (!request->argv) {
+		return false;
+	}
+	request->argv[0] = "labnag";
+	char *arg = request->buffer + strlen(request->cwd) + 1;
+	for (int i = 1; i < request->argc; i++) {
+		request->argv[i] = arg;
+		arg += strlen(arg) + 1;
+	}
+	return true;
+}
+
+int
+ipc_reader_read(struct ipc_reader *reader, int fd, struct ipc_request *request)
+{
+	/* The size, with the stdin of the client */
+	while (reader->len < sizeof(reader->size)) {
+		struct iovec iov = {
+			.iov_base = (char *)&reader->size + reader->len,
+			.iov_len = sizeof(reader->size) - reader->len,
+		};
+		union {
+			char buf[CMSG_SPACE(sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buf,
+			.msg_controllen = sizeof(control.buf),
+		};
+		/* Not to be inherited by the actions of buttons */
+		ssize_t nread = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		} else if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else if (nread <= 0) {
+			return -1;
+		}
+		receive_fds(&msg, &reader->request.stdin_fd);
+		if (msg.msg_flags & MSG_CTRUNC) {
+			goto invalid;
+		}
+		reader->len += nread;
+	}
+
+	struct ipc_request *received = &reader->request;
+	if (!received->buffer) {
+		if (reader->size == 0 || reader->size > IPC_MAX_REQUEST) {
+			goto invalid;
+		}
+		received->buffer = malloc(reader->size);
+		if (!received->buffer) {
+			return -1;
+		}
+		received->size = reader->size;
+	}
+
+	size_t offset = reader->len - sizeof(reader->size);
+	while (offset < received->size) {
+		ssize_t nread = recv(fd, received->buffer + offset,
+			received->size - offset, 0);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		} else if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else if (nread <= 0) {
+			return -1;
+		}
+		offset += nread;
+		reader->len += nread;
+	}
+
+	if (!parse_request(received)) {
+		goto invalid;
+	}
+	*request = *received;
+	*received = (struct ipc_request){ .stdin_fd = -1 };
+	return 1;
+
+invalid:
+	wlr_log(WLR_ERROR, "Invalid request");
+	return -1;
+}
+
+void
+ipc_reader_finish(struct ipc_reader *reader)
+{
+	ipc_request_finish(&reader->request);
+}
+
+void
+ipc_request_finish(struct ipc_request *request)
+{
+	free(request->argv);
+	free(request->buffer);
+	if (request->stdin_fd >= 0) {
+		close(request->stdin_fd);
+	}
+	*request = (struct ipc_request){ .stdin_fd = -1 };
+}
+
+void
+ipc_send_reply(int fd, int status)
+{
+	uint8_t reply = status;
+	send_all(fd, &reply, sizeof(reply));
+}
+
+int
+ipc_read_reply(int fd)
+{
+	uint8_t reply;
+	if (!recv_all(fd, &reply, sizeof(reply))) {
+		return -1;
+	}
+	return reply;
+}
@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef LAB_IPC_H
+#define LAB_IPC_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * With --daemon, labnag listens on $XDG_RUNTIME_DIR/labnag-$WAYLAND_DISPLAY.sock
+ * and other invocations hand their arguments to it rather than connecting to
+ * the compositor themselves. With --replace <tag>, a bar listens on
+ * labnag-$WAYLAND_DISPLAY-<tag>.sock there instead, for messages to replace
+ * its own with. The runtime dir keeps other users from connecting to either.
+ *
+ * A request is the size of its payload as a uint32_t, followed by the working
+ * directory and the arguments, each terminated by a NUL. The stdin of the
+ * client is passed along with the size. The reply is a single byte, the exit
+ * status of the client.
+ */
+
+#define IPC_MAX_REQUEST (1024 * 1024)
+
+struct ipc_request {
+	char *buffer;
+	size_t size;
+	const char *cwd;
+	int argc;
+	char **argv; /* NULL terminated, with a placeholder for argv[0] */
+	int stdin_fd; /* or -1 */
+};
+
+/*
+ * Returns a socket listening for @tag, or for the daemon if NULL. Returns -1
+ * if that cannot be created or is in use.
+ */
+int ipc_listen(const char *tag);
+
+/* Unlink the socket created by ipc_listen() and close @fd */
+void ipc_close(int fd, const char *tag);
+
+/* Returns a connection to whoever listens for @tag, or -1 */
+int ipc_connect(const char *tag);
+
+/*
+ * A request received as its bytes come in, so that a slow client holds up
+ * nothing but itself. It has to be complete within a second.
+ */
+struct ipc_reader {
+	int64_t deadline; /* CLOCK_MONOTONIC, in milliseconds */
+	uint32_t size;
+	size_t len; /* received so far, of the size and then of the payload */
+	struct ipc_request request;
+};
+
+/* Returns the accepted connection, non-blocking, or -1 */
+int ipc_accept(int listen_fd);
+
+/* Send @argc arguments, the working directory and stdin */
+bool ipc_send_request(int fd, int argc, char **argv);
+
+/* Start receiving the request of a new connection */
+void ipc_reader_init(struct ipc_reader *reader);
+
+/*
+ * Receive what has arrived on @fd. Returns 1 once the request is complete
+ * and moved to @request, 0 if more is to come, or -1 if it is invalid or the
+ * client went away.
+ */
+int ipc_reader_read(struct ipc_reader *reader, int fd,
+		struct ipc_request *request);
+
+/* Milliseconds left for the request to be complete, 0 if it timed out */
+int ipc_reader_timeout(const struct ipc_reader *reader);
+
+/* Drop what was received so far, but not the connection */
+void ipc_reader_finish(struct ipc_reader *reader);
+
+void ipc_request_finish(struct ipc_request *request);
+
+void ipc_send_reply(int fd, int status);
+
+/* Wait for the reply, or return -1 if the daemon went away */
+int ipc_read_reply(int fd);
+
+#endif /* LAB_IPC_H */
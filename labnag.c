@@ -9,8 +9,10 @@
 #include <assert.h>
 #include <cairo.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <glib.h>
+#include <math.h>
 #include <pango/pangocairo.h>
 #include <poll.h>
 #include <stdio.h>
@@ -20,8 +22,10 @@
 #ifdef __FreeBSD__
 #include <sys/event.h> /* For signalfd() */
 #endif
+#include <sys/mman.h>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -29,13 +33,30 @@
 #include <wayland-client.h>
 #include <wayland-cursor.h>
 #include <wlr/util/log.h>
+#include "details.h"
+#include "details-reader.h"
+#include "display-list.h"
+#include "ipc.h"
 #include "pool-buffer.h"
 #include "cursor-shape-v1-client-protocol.h"
+#include "fractional-scale-v1-client-protocol.h"
+#include "single-pixel-buffer-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 
 #define LABNAG_MAX_HEIGHT 500
+#define LAYOUT_CACHE_SIZE 32
+#define MAX_BUFFERS 4
+#define KINETIC_INTERVAL_MS 16
+#define KINETIC_FRICTION 0.95 /* velocity kept per interval */
+#define KINETIC_MIN_VELOCITY 30.0 /* pixels per second */
 #define LAB_EXIT_FAILURE 255
 #define LAB_EXIT_SUCCESS 0
+#define DAEMON_STACK 3
+#define CONTROL_MAX_LINE 4096
+#define PENDING_REQUESTS 16 /* received at once, the others wait */
+#define PRUNE_INTERVAL_MS 1000
+#define PROGRESS_WIDTH 200
 
 struct conf {
 	PangoFontDescription *font_description;
@@ -68,11 +89,30 @@ struct nag;
 struct pointer {
 	struct wl_pointer *pointer;
 	uint32_t serial;
-	struct wl_cursor_theme *cursor_theme;
+	struct wl_cursor_theme *cursor_theme; /* owned by nag.cursor_themes */
 	struct wl_cursor_image *cursor_image;
 	struct wl_surface *cursor_surface;
 	int x;
 	int y;
+
+	/* Scrolling gathered until the next wl_pointer.frame */
+	double scroll; /* surface pixels */
+	int32_t scroll120; /* wheel notches in 1/120 */
+	bool scrolled;
+	bool scroll_stop;
+	uint32_t scroll_time;
+	uint32_t stop_time;
+	uint32_t last_scroll_time; /* of the previous frame which scrolled */
+	uint32_t axis_source;
+	double velocity; /* pixels per second while scrolling with fingers */
+};
+
+/* Loaded once per name and size, and shared by all seats */
+struct cursor_theme {
+	const char *name; /* NULL for the default theme */
+	int size; /* in buffer pixels */
+	struct wl_cursor_theme *theme; /* NULL if it failed to load */
+	struct wl_list link; /* nag.cursor_themes */
 };
 
 struct seat {
@@ -104,19 +144,98 @@ struct button {
 	struct wl_list link;
 };
 
+struct layout_cache_entry {
+	char *text;
+	PangoFontDescription *font;
+	double scale;
+	double output_scale;
+	bool markup;
+	PangoLayout *layout;
+	struct wl_list link; /* nag.layout_cache */
+};
+
+/*
+ * A message sent to the daemon, shown or waiting to be. Requests for the same
+ * message are answered together.
+ */
+struct queued {
+	struct ipc_request request;
+	uint64_t key; /* of the request and the stdin it came with */
+	int *clients;
+	size_t nr_clients;
+	int status; /* the exit status they get */
+
+	/* Parsed ahead, to stack the message below the one shown */
+	const char *message;
+	const char *tag; /* --replace */
+	struct wl_list buttons;
+	bool stacked;
+	int y;
+	struct wl_list link; /* nag.queue */
+};
+
+/*
+ * Parts of the bar with a surface each. Those drawn with shm buffers are
+ * sized to their content, so that memory use and rasterization do not grow
+ * with the width of the output. The background and the bottom border are
+ * single pixel buffers stretched by a viewport where that is supported, and
+ * otherwise drawn to the bar surface itself.
+ */
+enum {
+	PANEL_BAR, /* the layer surface */
+	PANEL_MESSAGE,
+	PANEL_BUTTONS,
+	PANEL_DETAILS,
+	PANEL_BORDER, /* only used with single pixel buffers */
+
+	NR_PANELS,
+};
+
+struct panel {
+	struct wl_surface *surface;
+	struct wl_subsurface *subsurface; /* NULL for PANEL_BAR */
+	struct wp_viewport *viewport;
+	struct wl_buffer *solid; /* a single pixel, or NULL if drawn */
+	struct swapchain swapchain;
+	struct pool_buffer *buffer; /* to draw the next frame to */
+
+	/* What the next frame, each buffer and the compositor hold */
+	struct display_list list;
+	struct display_list buffer_lists[SWAPCHAIN_MAX_BUFFERS];
+	struct display_list committed_list;
+	struct display_damage damage; /* between list and committed_list */
+	bool changed;
+	uint64_t opaque_key; /* of the opaque region last sent */
+};
+
 enum {
 	FD_WAYLAND,
 	FD_TIMER,
 	FD_SIGNAL,
-
-	NR_FDS,
+	FD_STDIN,
+	FD_SCROLL,
+	FD_CONTROL, /* --control-fd */
+	FD_CLIENT, /* of the request shown with --daemon */
+	FD_LISTEN,
+	FD_PENDING, /* connections with a request being received */
+
+	NR_FDS = FD_PENDING + PENDING_REQUESTS,
 };
 
 struct nag {
 	bool run_display;
+	bool daemon; /* --daemon */
+	bool quit; /* on SIGINT or SIGTERM */
+	struct wl_list queue; /* struct queued, the first one shown */
+	int stack; /* messages shown at once */
+	bool closed; /* the bar, by the compositor */
+	const char *tag; /* --replace, of the message shown */
+	struct ipc_request handoff; /* the message shown, if it replaced one */
 
 	struct wl_display *display;
+	struct wl_registry *registry;
 	struct wl_compositor *compositor;
+	struct wl_subcompositor *subcompositor;
 	struct wl_seat *seat;
 	struct wl_shm *shm;
 	struct wl_list outputs;
@@ -125,23 +244,79 @@ struct nag {
 	struct zwlr_layer_shell_v1 *layer_shell;
 	struct zwlr_layer_surface_v1 *layer_surface;
 	struct wp_cursor_shape_manager_v1 *cursor_shape_manager;
+	struct wp_viewporter *viewporter;
+	struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
+	struct wp_single_pixel_buffer_manager_v1 *single_pixel_manager;
 	struct wl_surface *surface;
+	struct wp_fractional_scale_v1 *fractional_scale;
 
 	uint32_t width;
 	uint32_t height;
-	int32_t scale;
-	struct pool_buffer buffers[2];
-	struct pool_buffer *current_buffer;
+	double scale; /* buffer pixels per surface pixel */
+	int32_t output_scale; /* of the output, used for cursors */
+	struct panel panels[NR_PANELS];
+	bool waiting_for_buffer;
+
+	/* Rendering is deferred until the compositor asks for a new frame */
+	bool dirty;
+	bool configure_pending;
+	struct wl_callback *frame_callback;
+
+	PangoContext *pango;
+	cairo_surface_t *measure_surface;
+	cairo_t *measure_cairo;
+	struct wl_list layout_cache;
+
+	/* Without cursor-shape-v1, from XCURSOR_THEME and XCURSOR_SIZE */
+	const char *cursor_theme_name;
+	unsigned int cursor_size;
+	struct wl_list cursor_themes;
 
 	struct conf *conf;
 	char *message;
 	struct wl_list buttons;
 	struct pollfd pollfds[NR_FDS];
+	struct ipc_reader pending[PENDING_REQUESTS]; /* of FD_PENDING on */
+
+	/* --progress, shown next to the message */
+	struct {
+		bool enabled;
+		double percent;
+	} progress;
+
+	/* --control-fd, commands changing the message while it is shown */
+	struct {
+		int fd; /* or -1 */
+		int flags; /* of the file, restored when done reading it */
+		char buffer[CONTROL_MAX_LINE]; /* of the line being read */
+		size_t len;
+		bool skip_line; /* discard input up to the next newline */
+		char *message; /* set by a command */
+		char *details; /* lines held back until stdin is read */
+		size_t details_len;
+	} control;
 
 	struct {
 		bool visible;
-		char *message;
+		const char *path; /* --details-file */
+		bool read_stdin;
+		char *message; /* read from a pipe */
+		void *mapping; /* or mapped from --details-file */
+		size_t mapping_size;
+		const char *text;
+		size_t text_len;
+		size_t max_bytes;
+		size_t max_lines;
+		size_t tail_lines;
+
+		/* --follow: stdin is read from the event loop */
+		bool follow;
+		bool follow_bottom; /* stick to the end unless scrolled up */
+		bool reading;
+		int stdin_flags; /* of the file, restored when done reading it */
+		struct details_reader reader;
 		char *details_text;
+		char *loading_text; /* details button text until stdin is read */
 		int close_timeout;
 		bool use_exclusive_zone;
 
@@ -150,9 +325,19 @@ struct nag {
 		int width;
 		int height;
 
-		int offset;
+		struct details_model model;
+		struct details_pos pos;
+		int offset; /* pango units scrolled into the first line */
+		struct details_pos end; /* the furthest scroll position */
+		double scroll_remainder; /* below a device pixel, not applied */
+		double velocity; /* kinetic scrolling, pixels per second */
 		int visible_lines;
-		int total_lines;
+		size_t last; /* the last paragraph of the visible lines */
+		bool more; /* text left below the visible lines */
+		bool show_buttons;
+		bool overflow; /* too tall for the panel without scrolling */
+		uint64_t overflow_key; /* what overflow was worked out for */
+		uint32_t overflow_revision; /* of the text it was worked out for */
 		struct button *button_details;
 		struct button button_up;
 		struct button button_down;
@@ -162,13 +347,19 @@ struct nag {
 static int exit_status = LAB_EXIT_FAILURE;
 
 static void close_pollfd(struct pollfd *pollfd);
+static int set_nonblock(int fd);
+static void close_nonblock(struct pollfd *pollfd, int flags);
+static void nag_init_message(struct nag *nag, struct conf *conf);
+static int nag_parse_options(int argc, char **argv, struct nag *nag,
+		struct conf *conf, bool *debug);
+static bool nag_replace_message(struct nag *nag, struct ipc_request *request);
+static bool queued_prune(struct queued *entry);
 
 static PangoLayout *
-get_pango_layout(cairo_t *cairo, const PangoFontDescription *desc,
+get_pango_layout(PangoContext *context, const PangoFontDescription *desc,
 		const char *text, double scale, bool markup)
 {
-	PangoLayout *layout = pango_cairo_create_layout(cairo);
-	pango_context_set_round_glyph_positions(pango_layout_get_context(layout), false);
+	PangoLayout *layout = pango_layout_new(context);
 
 	PangoAttrList *attrs;
 	if (markup) {
@@ -198,50 +389,75 @@ get_pango_layout(cairo_t *cairo, const PangoFontDescription *desc,
 }
 
 static void
-get_text_size(cairo_t *cairo, const PangoFontDescription *desc, int *width, int *height,
-		int *baseline, double scale, bool markup, const char *fmt, ...)
+layout_cache_entry_destroy(struct layout_cache_entry *entry)
 {
-	va_list args;
-	va_start(args, fmt);
-	gchar *buf = g_strdup_vprintf(fmt, args);
-	va_end(args);
-	if (!buf) {
-		return;
+	wl_list_remove(&entry->link);
+	g_object_unref(entry->layout);
+	pango_font_description_free(entry->font);
+	free(entry->text);
+	free(entry);
+}
+
+static void
+layout_cache_clear(struct nag *nag)
+{
+	struct layout_cache_entry *entry, *tmp;
+	wl_list_for_each_safe(entry, tmp, &nag->layout_cache, link) {
+		layout_cache_entry_destroy(entry);
+	}
+}
+
+/*
+ * Returns a shaped layout for the given text, shared between measuring and
+ * drawing. The layout is owned by the cache, so callers must not unref it.
+ * Entries are kept in most-recently-used order and the least recently used
+ * one is evicted once LAYOUT_CACHE_SIZE is reached.
+ */
+static PangoLayout *
+get_cached_layout(struct nag *nag, const char *text, double scale, bool markup)
+{
+	const PangoFontDescription *desc = nag->conf->font_description;
+
+	struct layout_cache_entry *entry;
+	int nr_entries = 0;
+	wl_list_for_each(entry, &nag->layout_cache, link) {
+		if (entry->scale == scale && entry->markup == markup
+				&& entry->output_scale == nag->scale
+				&& strcmp(entry->text, text) == 0
+				&& pango_font_description_equal(entry->font, desc)) {
+			wl_list_remove(&entry->link);
+			wl_list_insert(&nag->layout_cache, &entry->link);
+			return entry->layout;
+		}
+		++nr_entries;
 	}
 
-	PangoLayout *layout = get_pango_layout(cairo, desc, buf, scale, markup);
-	pango_cairo_update_layout(cairo, layout);
-	pango_layout_get_pixel_size(layout, width, height);
-	if (baseline) {
-		*baseline = pango_layout_get_baseline(layout) / PANGO_SCALE;
+	if (nr_entries >= LAYOUT_CACHE_SIZE) {
+		entry = wl_container_of(nag->layout_cache.prev, entry, link);
+		layout_cache_entry_destroy(entry);
 	}
-	g_object_unref(layout);
 
-	g_free(buf);
+	entry = calloc(1, sizeof(*entry));
+	assert(entry);
+	entry->text = strdup(text);
+	entry->font = pango_font_description_copy(desc);
+	entry->scale = scale;
+	entry->output_scale = nag->scale;
+	entry->markup = markup;
+	entry->layout = get_pango_layout(nag->pango, desc, text, scale, markup);
+	wl_list_insert(&nag->layout_cache, &entry->link);
+	return entry->layout;
 }
 
 static void
-render_text(cairo_t *cairo, const PangoFontDescription *desc, double scale,
-		bool markup, const char *fmt, ...)
+get_text_size(struct nag *nag, int *width, int *height, int *baseline,
+		double scale, bool markup, const char *text)
 {
-	va_list args;
-	va_start(args, fmt);
-	gchar *buf = g_strdup_vprintf(fmt, args);
-	va_end(args);
-	if (!buf) {
-		return;
+	PangoLayout *layout = get_cached_layout(nag, text, scale, markup);
+	pango_layout_get_pixel_size(layout, width, height);
+	if (baseline) {
+		*baseline = pango_layout_get_baseline(layout) / PANGO_SCALE;
 	}
-
-	PangoLayout *layout = get_pango_layout(cairo, desc, buf, scale, markup);
-	cairo_font_options_t *fo = cairo_font_options_create();
-	cairo_get_font_options(cairo, fo);
-	pango_cairo_context_set_font_options(pango_layout_get_context(layout), fo);
-	cairo_font_options_destroy(fo);
-	pango_cairo_update_layout(cairo, layout);
-	pango_cairo_show_layout(cairo, layout);
-	g_object_unref(layout);
-
-	g_free(buf);
 }
 
 static void
@@ -255,65 +471,115 @@ cairo_set_source_u32(cairo_t *cairo, uint32_t color)
 }
 
 static uint32_t
-render_message(cairo_t *cairo, struct nag *nag)
+layout_message(struct nag *nag, const char *message)
 {
 	int text_width, text_height;
-	get_text_size(cairo, nag->conf->font_description, &text_width,
-		&text_height, NULL, 1, true, "%s", nag->message);
+	get_text_size(nag, &text_width, &text_height, NULL, 1, false,
+		message);
 
-	int padding = nag->conf->message_padding;
+	return text_height + nag->conf->message_padding * 2;
+}
+
+/* Add a text run with its origin at @x, @y */
+static void
+render_text(struct display_list *list, struct nag *nag, int x, int y,
+		uint32_t color, bool markup, const char *text)
+{
+	PangoLayout *layout = get_cached_layout(nag, text, 1, markup);
+	PangoRectangle ink, logical;
+	pango_layout_get_pixel_extents(layout, &ink, &logical);
+
+	/* Glyphs may reach outside their logical extents, antialiasing one more */
+	int x0 = ink.x < logical.x ? ink.x : logical.x;
+	int y0 = ink.y < logical.y ? ink.y : logical.y;
+	int x1 = ink.x + ink.width > logical.x + logical.width
+		? ink.x + ink.width : logical.x + logical.width;
+	int y1 = ink.y + ink.height > logical.y + logical.height
+		? ink.y + ink.height : logical.y + logical.height;
+
+	struct display_item *item = display_list_add(list, DISPLAY_TEXT,
+		x + x0 - 1, y + y0 - 1, x1 - x0 + 2, y1 - y0 + 2, color);
+	item->x = x;
+	item->y = y;
+	item->markup = markup;
+	item->key = display_hash(DISPLAY_HASH_INIT, text, strlen(text));
+	item->data = text;
+}
+
+static void
+render_message(struct display_list *list, struct nag *nag,
+		const char *message, int y)
+{
+	int text_width, text_height;
+	get_text_size(nag, &text_width, &text_height, NULL, 1, false,
+		message);
 
+	int padding = nag->conf->message_padding;
 	uint32_t ideal_height = text_height + padding * 2;
-	uint32_t ideal_surface_height = ideal_height;
-	if (nag->height < ideal_surface_height) {
-		return ideal_surface_height;
-	}
 
-	cairo_set_source_u32(cairo, nag->conf->text);
-	cairo_move_to(cairo, padding, (int)(ideal_height - text_height) / 2);
-	render_text(cairo, nag->conf->font_description, 1, false,
-			"%s", nag->message);
+	render_text(list, nag, padding,
+		y + (int)(ideal_height - text_height) / 2,
+		nag->conf->text, false, message);
+}
+
+/*
+ * The track of the progress bar and the part of it filled so far. Only the
+ * fill changes with the progress, and only in width, so that a frame just
+ * repaints and damages the span it moved by.
+ */
+static void
+render_progress(struct display_list *list, struct nag *nag)
+{
+	int text_width, text_height;
+	get_text_size(nag, &text_width, &text_height, NULL, 1, false,
+		nag->message);
 
-	return ideal_surface_height;
+	int padding = nag->conf->message_padding;
+	uint32_t ideal_height = text_height + padding * 2;
+	int height = text_height / 2;
+	int x = text_width + padding * 2;
+	int y = (int)(ideal_height - height) / 2;
+	display_list_add(list, DISPLAY_RECT, x, y, PROGRESS_WIDTH, height,
+		nag->conf->button_background);
+
+	int width = lround(PROGRESS_WIDTH * nag->progress.percent / 100);
+	if (width > 0) {
+		display_list_add(list, DISPLAY_RECT, x, y, width, height,
+			nag->conf->text);
+	}
 }
 
 static void
-render_details_scroll_button(cairo_t *cairo, struct nag *nag,
+render_details_scroll_button(struct display_list *list, struct nag *nag,
 		struct button *button)
 {
 	int text_width, text_height;
-	get_text_size(cairo, nag->conf->font_description, &text_width,
-		&text_height, NULL, 1, true, "%s", button->text);
+	get_text_size(nag, &text_width, &text_height, NULL, 1, true,
+		button->text);
 
 	int border = nag->conf->button_border_thickness;
 	int padding = nag->conf->button_padding;
 
-	cairo_set_source_u32(cairo, nag->conf->details_background);
-	cairo_rectangle(cairo, button->x, button->y,
-			button->width, button->height);
-	cairo_fill(cairo);
+	display_list_add(list, DISPLAY_RECT, button->x, button->y,
+		button->width, button->height, nag->conf->details_background);
 
-	cairo_set_source_u32(cairo, nag->conf->button_background);
-	cairo_rectangle(cairo, button->x + border, button->y + border,
-			button->width - (border * 2),
-			button->height - (border * 2));
-	cairo_fill(cairo);
+	display_list_add(list, DISPLAY_RECT, button->x + border,
+		button->y + border, button->width - (border * 2),
+		button->height - (border * 2), nag->conf->button_background);
 
-	cairo_set_source_u32(cairo, nag->conf->button_text);
-	cairo_move_to(cairo, button->x + border + padding,
-			button->y + border + (button->height - text_height) / 2);
-	render_text(cairo, nag->conf->font_description, 1, true,
-			"%s", button->text);
+	render_text(list, nag, button->x + border + padding,
+		button->y + border + (button->height - text_height) / 2,
+		nag->conf->button_text, true, button->text);
 }
 
 static int
-get_detailed_scroll_button_width(cairo_t *cairo, struct nag *nag)
+get_detailed_scroll_button_width(struct nag *nag)
 {
 	int up_width, down_width, temp_height;
-	get_text_size(cairo, nag->conf->font_description, &up_width, &temp_height,
-		NULL, 1, true, "%s", nag->details.button_up.text);
-	get_text_size(cairo, nag->conf->font_description, &down_width, &temp_height,
-		NULL, 1, true, "%s", nag->details.button_down.text);
+	get_text_size(nag, &up_width, &temp_height, NULL, 1, true,
+		nag->details.button_up.text);
+	get_text_size(nag, &down_width, &temp_height, NULL, 1, true,
+		nag->details.button_down.text);
 
 	int text_width =  up_width > down_width ? up_width : down_width;
 	int border = nag->conf->button_border_thickness;
@@ -322,8 +588,63 @@ get_detailed_scroll_button_width(cairo_t *cairo, struct nag *nag)
 	return text_width + border * 2 + padding * 2;
 }
 
+static bool
+details_at_top(struct nag *nag)
+{
+	return nag->details.pos.paragraph == 0 && nag->details.pos.line == 0
+		&& nag->details.offset == 0;
+}
+
+/*
+ * Whether the details are too tall for the panel when scrolled to the top,
+ * at the width they have without the scroll buttons. This is remembered
+ * until the text, the width or the pango context change, and an overflow
+ * until text is dropped from the front. With more
+ * paragraphs than lines fit, it is certain without shaping anything.
+ */
+static bool
+details_overflow(struct nag *nag, int max_text_height)
+{
+	/* The height follows the rows above, e.g. the message or stacked ones */
+	unsigned int context_serial = pango_context_get_serial(nag->pango);
+	unsigned int font = pango_font_description_hash(
+		nag->conf->font_description);
+	struct details_model *model = &nag->details.model;
+	uint64_t key = DISPLAY_HASH_INIT;
+	key = display_hash(key, &nag->details.width, sizeof(nag->details.width));
+	key = display_hash(key, &max_text_height, sizeof(max_text_height));
+	key = display_hash(key, &model->drops, sizeof(model->drops));
+	key = display_hash(key, &context_serial, sizeof(context_serial));
+	key = display_hash(key, &font, sizeof(font));
+	/* Text appended since cannot make the details fit again */
+	if (key == nag->details.overflow_key && (nag->details.overflow
+			|| model->revision == nag->details.overflow_revision)) {
+		return nag->details.overflow;
+	}
+	nag->details.overflow_key = key;
+	nag->details.overflow_revision = model->revision;
+
+	int line_width, line_height;
+	get_text_size(nag, &line_width, &line_height, NULL, 1, false, " ");
+	if (model->nr_paragraphs * line_height > (size_t)max_text_height) {
+		nag->details.overflow = true;
+		return true;
+	}
+
+	int padding = nag->conf->message_padding;
+	details_model_configure(model, nag->pango,
+		nag->conf->font_description,
+		(nag->details.width - padding * 2) * PANGO_SCALE);
+	struct details_pos top = { 0 };
+	int text_height;
+	size_t last;
+	details_model_measure(model, &top, max_text_height, &text_height,
+		&last, &nag->details.overflow);
+	return nag->details.overflow;
+}
+
 static uint32_t
-render_detailed(cairo_t *cairo, struct nag *nag, uint32_t y)
+layout_detailed(struct nag *nag, uint32_t y)
 {
 	uint32_t width = nag->width;
 
@@ -335,346 +656,1567 @@ render_detailed(cairo_t *cairo, struct nag *nag, uint32_t y)
 	nag->details.y = y + decor;
 	nag->details.width = width - decor * 2;
 
-	PangoLayout *layout = get_pango_layout(cairo, nag->conf->font_description,
-			nag->details.message, 1, false);
-	pango_layout_set_width(layout,
-			(nag->details.width - padding * 2) * PANGO_SCALE);
-	pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
-	pango_layout_set_single_paragraph_mode(layout, false);
-	pango_cairo_update_layout(cairo, layout);
-	nag->details.total_lines = pango_layout_get_line_count(layout);
-
-	PangoLayoutLine *line;
-	line = pango_layout_get_line_readonly(layout, nag->details.offset);
-	gint offset = line->start_index;
-	const char *text = pango_layout_get_text(layout);
-	pango_layout_set_text(layout, text + offset, strlen(text) - offset);
-
-	int text_width, text_height;
-	pango_cairo_update_layout(cairo, layout);
-	pango_layout_get_pixel_size(layout, &text_width, &text_height);
+	/* Only the paragraphs which fit in the tallest possible panel are shaped */
+	int max_text_height =
+		LABNAG_MAX_HEIGHT - nag->details.y - decor - padding * 2;
+	/* Tall rows above may leave no room at all */
+	if (max_text_height < 0) {
+		max_text_height = 0;
+	}
 
-	bool show_buttons = nag->details.offset > 0;
-	int button_width = get_detailed_scroll_button_width(cairo, nag);
+	/* Decide on the scroll buttons first, so the text is wrapped once */
+	bool show_buttons = !details_at_top(nag)
+		|| details_overflow(nag, max_text_height);
+	int button_width = get_detailed_scroll_button_width(nag);
 	if (show_buttons) {
 		nag->details.width -= button_width;
-		pango_layout_set_width(layout,
-				(nag->details.width - padding * 2) * PANGO_SCALE);
 	}
 
-	uint32_t ideal_height;
-	do {
-		ideal_height = nag->details.y + text_height + decor + padding * 2;
-		if (ideal_height > LABNAG_MAX_HEIGHT) {
-			ideal_height = LABNAG_MAX_HEIGHT;
-
-			if (!show_buttons) {
-				show_buttons = true;
-				nag->details.width -= button_width;
-				pango_layout_set_width(layout,
-					(nag->details.width - padding * 2) * PANGO_SCALE);
-			}
-		}
-
-		nag->details.height = ideal_height - nag->details.y - decor;
-		pango_layout_set_height(layout,
-				(nag->details.height - padding * 2) * PANGO_SCALE);
-		pango_layout_set_ellipsize(layout, PANGO_ELLIPSIZE_END);
-		pango_cairo_update_layout(cairo, layout);
-		pango_layout_get_pixel_size(layout, &text_width, &text_height);
-	} while (text_height != (nag->details.height - padding * 2));
-
-	nag->details.visible_lines = pango_layout_get_line_count(layout);
+	struct details_model *model = &nag->details.model;
+	struct details_pos *pos = &nag->details.pos;
+	int text_height;
+	details_model_configure(model, nag->pango, nag->conf->font_description,
+		(nag->details.width - padding * 2) * PANGO_SCALE);
+	details_model_scroll(model, pos, 0);
+	details_model_scroll_to_end(model, &nag->details.end, max_text_height);
+	if (nag->details.follow && nag->details.follow_bottom) {
+		*pos = nag->details.end;
+	}
+	details_model_scroll_by(model, pos, &nag->details.offset, 0,
+		&nag->details.end);
+	/* Lines scrolled partly out at the top leave room at the bottom */
+	nag->details.visible_lines = details_model_measure(model, pos,
+		max_text_height + PANGO_PIXELS_CEIL(nag->details.offset),
+		&text_height, &nag->details.last, &nag->details.more);
+	if (!nag->details.more) {
+		nag->details.follow_bottom = true;
+	}
+	details_model_release_layouts(model, nag->details.pos.paragraph,
+		nag->details.last);
+
+	/* Once scrolled, the panel keeps its full height up to the end */
+	uint32_t ideal_height = nag->details.y + text_height + decor + padding * 2;
+	if (nag->details.more || !details_at_top(nag)
+			|| ideal_height > LABNAG_MAX_HEIGHT) {
+		ideal_height = LABNAG_MAX_HEIGHT;
+	}
+	uint32_t min_height = nag->details.y + decor + padding * 2;
+	if (ideal_height < min_height) {
+		ideal_height = min_height;
+	}
+	nag->details.height = ideal_height - nag->details.y - decor;
 
+	nag->details.show_buttons = show_buttons;
 	if (show_buttons) {
 		nag->details.button_up.x = nag->details.x + nag->details.width;
 		nag->details.button_up.y = nag->details.y;
 		nag->details.button_up.width = button_width;
 		nag->details.button_up.height = nag->details.height / 2;
-		render_details_scroll_button(cairo, nag, &nag->details.button_up);
 
 		nag->details.button_down.x = nag->details.x + nag->details.width;
 		nag->details.button_down.y =
 			nag->details.button_up.y + nag->details.button_up.height;
 		nag->details.button_down.width = button_width;
 		nag->details.button_down.height = nag->details.height / 2;
-		render_details_scroll_button(cairo, nag, &nag->details.button_down);
 	}
 
-	cairo_set_source_u32(cairo, nag->conf->details_background);
-	cairo_rectangle(cairo, nag->details.x, nag->details.y,
-			nag->details.width, nag->details.height);
-	cairo_fill(cairo);
+	return ideal_height;
+}
+
+static void
+render_detailed(struct display_list *list, struct nag *nag)
+{
+	int padding = nag->conf->message_padding;
 
-	cairo_move_to(cairo, nag->details.x + padding, nag->details.y + padding);
-	cairo_set_source_u32(cairo, nag->conf->text);
-	pango_cairo_show_layout(cairo, layout);
-	g_object_unref(layout);
+	if (nag->details.show_buttons) {
+		render_details_scroll_button(list, nag, &nag->details.button_up);
+		render_details_scroll_button(list, nag, &nag->details.button_down);
+	}
 
-	return ideal_height;
+	display_list_add(list, DISPLAY_RECT, nag->details.x, nag->details.y,
+		nag->details.width, nag->details.height,
+		nag->conf->details_background);
+
+	/*
+	 * Identify the visible lines by the text of their paragraphs and the
+	 * scroll position, so text added or dropped out of view changes
+	 * nothing. The paragraph revisions are unique, unlike the indices.
+	 */
+	struct details_model *model = &nag->details.model;
+	struct details_pos *pos = &nag->details.pos;
+	uint64_t content = DISPLAY_HASH_INIT;
+	content = display_hash(content, &model->generation,
+		sizeof(model->generation));
+	uint64_t key = content;
+	for (size_t i = pos->paragraph; i <= nag->details.last; i++) {
+		key = display_hash(key, &model->paragraphs[i].revision,
+			sizeof(model->paragraphs[i].revision));
+	}
+	key = display_hash(key, &pos->line, sizeof(pos->line));
+	key = display_hash(key, &nag->details.offset,
+		sizeof(nag->details.offset));
+	key = display_hash(key, &nag->details.visible_lines,
+		sizeof(nag->details.visible_lines));
+	key = display_hash(key, &nag->details.more,
+		sizeof(nag->details.more));
+	content = display_hash(content, &model->drops, sizeof(model->drops));
+
+	struct display_item *item = display_list_add(list, DISPLAY_DETAILS,
+		nag->details.x, nag->details.y, nag->details.width,
+		nag->details.height, nag->conf->text);
+	item->x = nag->details.x + padding;
+	item->y = nag->details.y + padding;
+	item->key = key;
+	item->scroll.content = content;
+	item->scroll.revision = model->revision;
+	item->scroll.paragraph = pos->paragraph;
+	item->scroll.last = nag->details.last;
+	item->scroll.line = pos->line;
+	item->scroll.offset = nag->details.offset;
+	/* Including the line partly shown at the bottom */
+	item->scroll.nr_lines =
+		nag->details.visible_lines + nag->details.more;
+}
+
+/* The strip of a DISPLAY_DETAILS item the lines are drawn and clipped to */
+static struct display_rect
+details_view(struct nag *nag, const struct display_item *item)
+{
+	int padding = nag->conf->message_padding;
+	return (struct display_rect){ item->box.x, item->y, item->box.width,
+		item->box.height - padding * 2 };
 }
 
 static uint32_t
-render_button(cairo_t *cairo, struct nag *nag, struct button *button, int *x)
+layout_button(struct nag *nag, struct button *button, int *x, int y)
 {
 	int text_width, text_height;
-	get_text_size(cairo, nag->conf->font_description, &text_width,
-		&text_height, NULL, 1, true, "%s", button->text);
+	get_text_size(nag, &text_width, &text_height, NULL, 1, true,
+		button->text);
 
 	int border = nag->conf->button_border_thickness;
 	int padding = nag->conf->button_padding;
 
 	uint32_t ideal_height = text_height + padding * 2 + border * 2;
-	uint32_t ideal_surface_height = ideal_height;
-	if (nag->height < ideal_surface_height) {
-		return ideal_surface_height;
-	}
 
 	button->x = *x - border - text_width - padding * 2 + 1;
-	button->y = (int)(ideal_height - text_height) / 2 - padding + 1;
+	button->y = y + (int)(ideal_height - text_height) / 2 - padding + 1;
 	button->width = text_width + padding * 2;
 	button->height = text_height + padding * 2;
 
-	cairo_set_source_u32(cairo, nag->conf->border);
-	cairo_rectangle(cairo, button->x - border, button->y - border,
-			button->width + border * 2, button->height + border * 2);
-	cairo_fill(cairo);
+	*x = button->x - border;
+
+	return ideal_height;
+}
 
-	cairo_set_source_u32(cairo, nag->conf->button_background);
-	cairo_rectangle(cairo, button->x, button->y,
-			button->width, button->height);
-	cairo_fill(cairo);
+static void
+render_button(struct display_list *list, struct nag *nag,
+		struct button *button)
+{
+	int border = nag->conf->button_border_thickness;
+	int padding = nag->conf->button_padding;
 
-	cairo_set_source_u32(cairo, nag->conf->button_text);
-	cairo_move_to(cairo, button->x + padding, button->y + padding);
-	render_text(cairo, nag->conf->font_description, 1, true,
-			"%s", button->text);
+	display_list_add(list, DISPLAY_RECT, button->x - border,
+		button->y - border, button->width + border * 2,
+		button->height + border * 2, nag->conf->border);
 
-	*x = button->x - border;
+	display_list_add(list, DISPLAY_RECT, button->x, button->y,
+		button->width, button->height, nag->conf->button_background);
 
-	return ideal_surface_height;
+	render_text(list, nag, button->x + padding, button->y + padding,
+		nag->conf->button_text, true, button->text);
 }
 
-static uint32_t
-render_to_cairo(cairo_t *cairo, struct nag *nag)
+/*
+ * Text is shaped against a scratch image surface with the output transform,
+ * which has the same font options as the shm buffers drawn to later, so the
+ * layouts measured here are the ones rasterized.
+ */
+static void
+update_pango_context(struct nag *nag)
 {
-	uint32_t max_height = 0;
-
-	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
-	cairo_set_source_u32(cairo, nag->conf->background);
-	cairo_paint(cairo);
+	if (!nag->pango) {
+		nag->pango = pango_font_map_create_context(
+			pango_cairo_font_map_get_default());
+		pango_context_set_round_glyph_positions(nag->pango, false);
+		nag->measure_surface =
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
+		nag->measure_cairo = cairo_create(nag->measure_surface);
+	}
+	cairo_identity_matrix(nag->measure_cairo);
+	cairo_scale(nag->measure_cairo, nag->scale, nag->scale);
+	/* Only invalidates cached layouts if the transform or font options changed */
+	pango_cairo_update_context(nag->measure_cairo, nag->pango);
+}
 
-	uint32_t h = render_message(cairo, nag);
-	max_height = h > max_height ? h : max_height;
+/* Position a message and its buttons from @y and return their height */
+static uint32_t
+layout_row(struct nag *nag, const char *message, struct wl_list *buttons,
+		int y)
+{
+	uint32_t max_height = layout_message(nag, message);
 
 	int x = nag->width - nag->conf->button_margin_right;
 	x -= nag->conf->button_gap_close;
 
 	struct button *button;
-	wl_list_for_each(button, &nag->buttons, link) {
-		h = render_button(cairo, nag, button, &x);
+	wl_list_for_each(button, buttons, link) {
+		uint32_t h = layout_button(nag, button, &x, y);
 		max_height = h > max_height ? h : max_height;
 		x -= nag->conf->button_gap;
 	}
+	return max_height;
+}
 
-	if (nag->details.visible) {
-		h = render_detailed(cairo, nag, max_height);
-		max_height = h > max_height ? h : max_height;
+/* Position everything and return the height the bar needs */
+static uint32_t
+nag_layout(struct nag *nag)
+{
+	update_pango_context(nag);
+
+	uint32_t max_height = layout_row(nag, nag->message, &nag->buttons, 0);
+
+	/*
+	 * With --daemon, the messages queued behind are stacked below, in
+	 * the appearance of the first one. Half the bar is left to details.
+	 */
+	int nr_rows = 1;
+	struct queued *entry;
+	wl_list_for_each(entry, &nag->queue, link) {
+		entry->stacked = false;
+		if (entry->link.prev == &nag->queue || nr_rows >= nag->stack
+				|| max_height > LABNAG_MAX_HEIGHT / 2) {
+			continue;
+		}
+		/*
+		 * Not if its clients went away. It is dropped once it reaches
+		 * the front, as it may be in use by the caller.
+		 */
+		if (!queued_prune(entry)) {
+			continue;
+		}
+		entry->stacked = true;
+		entry->y = max_height;
+		max_height += layout_row(nag, entry->message, &entry->buttons,
+			max_height);
+		++nr_rows;
 	}
 
-	int border = nag->conf->bar_border_thickness;
-	if (max_height > nag->height) {
-		max_height += border;
+	if (nag->details.visible) {
+		uint32_t h = layout_detailed(nag, max_height);
+		max_height = h > max_height ? h : max_height;
 	}
-	cairo_set_source_u32(cairo, nag->conf->border_bottom);
-	cairo_rectangle(cairo, 0,
-			nag->height - border,
-			nag->width,
-			border);
-	cairo_fill(cairo);
 
 	return max_height;
 }
 
 static void
-render_frame(struct nag *nag)
+render_panel(struct display_list *list, struct nag *nag, int panel)
 {
-	if (!nag->run_display) {
-		return;
-	}
+	display_list_reset(list, nag->scale);
 
-	cairo_surface_t *recorder = cairo_recording_surface_create(
-			CAIRO_CONTENT_COLOR_ALPHA, NULL);
-	cairo_t *cairo = cairo_create(recorder);
-	cairo_scale(cairo, nag->scale, nag->scale);
-	cairo_save(cairo);
-	cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
-	cairo_paint(cairo);
-	cairo_restore(cairo);
-	uint32_t height = render_to_cairo(cairo, nag);
-	if (height != nag->height) {
-		zwlr_layer_surface_v1_set_size(nag->layer_surface, 0, height);
-		if (nag->details.use_exclusive_zone) {
-			zwlr_layer_surface_v1_set_exclusive_zone(
-				nag->layer_surface, height);
+	struct display_rect bar = { 0, 0, nag->width, nag->height };
+	int border = nag->conf->bar_border_thickness;
+	bool solid = nag->panels[PANEL_BAR].solid;
+	uint32_t background = nag->conf->background;
+
+	switch (panel) {
+	case PANEL_BAR:
+		display_list_add(list, DISPLAY_FILL, 0, 0, nag->width,
+			nag->height, background);
+		if (!solid) {
+			display_list_add(list, DISPLAY_RECT, 0,
+				nag->height - border, nag->width, border,
+				nag->conf->border_bottom);
 		}
-		wl_surface_commit(nag->surface);
-		wl_display_roundtrip(nag->display);
-	} else {
-		nag->current_buffer = get_next_buffer(nag->shm,
-				nag->buffers,
-				nag->width * nag->scale,
-				nag->height * nag->scale);
-		if (!nag->current_buffer) {
-			wlr_log(WLR_DEBUG, "Failed to get buffer. Skipping frame.");
-			goto cleanup;
+		display_list_fit(list, bar);
+		return;
+	case PANEL_BORDER:
+		if (solid) {
+			display_list_add(list, DISPLAY_RECT, 0,
+				nag->height - border, nag->width, border,
+				nag->conf->border_bottom);
 		}
+		display_list_fit(list, bar);
+		return;
+	}
 
-		cairo_t *shm = nag->current_buffer->cairo;
-		cairo_save(shm);
-		cairo_set_operator(shm, CAIRO_OPERATOR_CLEAR);
-		cairo_paint(shm);
-		cairo_restore(shm);
-		cairo_set_source_surface(shm, recorder, 0.0, 0.0);
-		cairo_paint(shm);
+	/*
+	 * Opaque content is drawn on the background, so the buffers can be
+	 * opaque too. Otherwise it is composited over the bar.
+	 */
+	if ((background & 0xFF) != 0xFF) {
+		background = 0;
+	}
+	display_list_add(list, DISPLAY_FILL, 0, 0, 0, 0, background);
 
-		wl_surface_set_buffer_scale(nag->surface, nag->scale);
-		wl_surface_attach(nag->surface,
-				nag->current_buffer->buffer, 0, 0);
-		wl_surface_damage(nag->surface, 0, 0,
-				nag->width, nag->height);
-		wl_surface_commit(nag->surface);
-		wl_display_roundtrip(nag->display);
+	struct button *button;
+	struct queued *entry;
+	switch (panel) {
+	case PANEL_MESSAGE:
+		render_message(list, nag, nag->message, 0);
+		if (nag->progress.enabled) {
+			render_progress(list, nag);
+		}
+		wl_list_for_each(entry, &nag->queue, link) {
+			if (entry->stacked) {
+				render_message(list, nag, entry->message,
+					entry->y);
+			}
+		}
+		break;
+	case PANEL_BUTTONS:
+		wl_list_for_each(button, &nag->buttons, link) {
+			render_button(list, nag, button);
+		}
+		wl_list_for_each(entry, &nag->queue, link) {
+			if (!entry->stacked) {
+				continue;
+			}
+			wl_list_for_each(button, &entry->buttons, link) {
+				render_button(list, nag, button);
+			}
+		}
+		break;
+	case PANEL_DETAILS:
+		if (nag->details.visible) {
+			render_detailed(list, nag);
+		}
+		break;
 	}
 
-cleanup:
-	cairo_surface_destroy(recorder);
-	cairo_destroy(cairo);
+	/* Sized to the content, above the bottom border */
+	bar.height -= border;
+	display_list_fit(list, bar);
+	list->items[0].box = list->area;
 }
 
+/*
+ * Add @box to the path, or fill it, on whole buffer pixels. At fractional
+ * scales the edges would otherwise be blended with what was there before.
+ */
 static void
-seat_destroy(struct seat *seat)
+fill_box(cairo_t *cairo, const struct display_list *list,
+		struct display_rect box, bool fill)
 {
-	if (seat->pointer.cursor_theme) {
-		wl_cursor_theme_destroy(seat->pointer.cursor_theme);
-	}
-	if (seat->pointer.pointer) {
-		wl_pointer_destroy(seat->pointer.pointer);
+	struct display_rect r = display_list_pixels(list, box);
+	cairo_save(cairo);
+	cairo_identity_matrix(cairo);
+	cairo_rectangle(cairo, r.x, r.y, r.width, r.height);
+	if (fill) {
+		cairo_fill(cairo);
 	}
-	wl_seat_destroy(seat->wl_seat);
-	wl_list_remove(&seat->link);
-	free(seat);
+	cairo_restore(cairo);
 }
 
+/* Replay @list, touching only the pixels inside @damage */
 static void
-nag_destroy(struct nag *nag)
+draw_list(cairo_t *cairo, struct nag *nag, const struct display_list *list,
+		const struct display_damage *damage)
 {
-	nag->run_display = false;
-
-	struct button *button, *next;
-	wl_list_for_each_safe(button, next, &nag->buttons, link) {
-		wl_list_remove(&button->link);
-		free(button);
+	cairo_save(cairo);
+	/* Clip to whole pixels, so that everything inside is repainted */
+	for (int i = 0; i < damage->nr_rects; i++) {
+		fill_box(cairo, list, damage->rects[i], false);
 	}
-	free(nag->details.message);
+	cairo_clip(cairo);
+	cairo_scale(cairo, list->scale, list->scale);
+	cairo_translate(cairo, -list->area.x, -list->area.y);
+
+	for (size_t i = 0; i < list->nr_items; i++) {
+		const struct display_item *item = &list->items[i];
+		cairo_set_source_u32(cairo, item->color);
+		switch (item->type) {
+		case DISPLAY_FILL:
+			cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+			fill_box(cairo, list, item->box, true);
+			cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+			break;
+		case DISPLAY_RECT:
+			fill_box(cairo, list, item->box, true);
+			break;
+		case DISPLAY_TEXT:
+			cairo_move_to(cairo, item->x, item->y);
+			pango_cairo_show_layout(cairo, get_cached_layout(nag,
+				item->data, 1, item->markup));
+			break;
+		case DISPLAY_DETAILS: {
+			struct display_rect view = details_view(nag, item);
+			cairo_save(cairo);
+			fill_box(cairo, list, view, false);
+			cairo_clip(cairo);
+			details_model_draw(&nag->details.model, cairo,
+				&nag->details.pos, item->scroll.nr_lines, item->x,
+				item->y - (double)item->scroll.offset / PANGO_SCALE);
+			cairo_restore(cairo);
+			break;
+		}
+		}
+	}
+	cairo_restore(cairo);
+}
 
-	pango_font_description_free(nag->conf->font_description);
+/*
+ * If scrolling the details is all that happened since @buffer was drawn from
+ * @contents, move the text which stays visible within the buffer and set
+ * @repaint to the strip it exposes. Returns false if the buffer has to be
+ * repainted from the diff instead.
+ */
+static bool
+scroll_details(struct nag *nag, struct pool_buffer *buffer,
+		const struct display_list *list,
+		const struct display_list *contents, struct display_damage *repaint)
+{
+	const struct display_item *old;
+	const struct display_item *item =
+		display_list_find_change(list, contents, &old);
+	if (!item || item->type != DISPLAY_DETAILS
+			|| item->scroll.content != old->scroll.content) {
+		return false;
+	}
 
-	if (nag->layer_surface) {
-		zwlr_layer_surface_v1_destroy(nag->layer_surface);
+	/* The lines kept from the buffer must not have changed since */
+	struct details_model *model = &nag->details.model;
+	if (details_model_first_change(model, old->scroll.revision)
+			<= old->scroll.last) {
+		return false;
+	}
+	struct details_pos from = { old->scroll.paragraph, old->scroll.line };
+	struct details_pos to = { item->scroll.paragraph, item->scroll.line };
+
+	/* How far the text moved up, in pango units */
+	int shift;
+	int nr_lines = details_model_distance(model, &from, &to,
+		old->scroll.nr_lines);
+	if (nr_lines >= 0) {
+		shift = details_model_span(model, &from, nr_lines)
+			+ item->scroll.offset - old->scroll.offset;
+	} else {
+		nr_lines = details_model_distance(model, &to, &from,
+			item->scroll.nr_lines);
+		if (nr_lines < 0) {
+			return false;
+		}
+		shift = -(details_model_span(model, &to, nr_lines)
+			+ old->scroll.offset - item->scroll.offset);
 	}
 
-	if (nag->surface) {
-		wl_surface_destroy(nag->surface);
+	/*
+	 * A fresh render would place the glyphs differently unless they move
+	 * by whole buffer pixels, give or take a pango unit of rounding.
+	 */
+	double exact = -(double)shift * list->scale / PANGO_SCALE;
+	int dy = lround(exact);
+	if (shift == 0 || fabs(exact - dy) * PANGO_SCALE > list->scale) {
+		return false;
 	}
+	int exposed = PANGO_PIXELS_CEIL(abs(shift));
 
-	if (nag->layer_shell) {
-		zwlr_layer_shell_v1_destroy(nag->layer_shell);
+	struct display_rect view = details_view(nag, item);
+	if (exposed >= view.height) {
+		return false;
 	}
 
-	if (nag->cursor_shape_manager) {
-		wp_cursor_shape_manager_v1_destroy(nag->cursor_shape_manager);
+	/* The pixels draw_list() clips the view to */
+	struct display_rect pixels = display_list_pixels(list, view);
+	int x1 = pixels.x + pixels.width;
+	int y1 = pixels.y + pixels.height;
+	x1 = x1 < (int)buffer->width ? x1 : (int)buffer->width;
+	y1 = y1 < (int)buffer->height ? y1 : (int)buffer->height;
+
+	cairo_surface_flush(buffer->surface);
+	unsigned char *data = cairo_image_surface_get_data(buffer->surface);
+	int stride = cairo_image_surface_get_stride(buffer->surface);
+	size_t x = pixels.x * 4;
+	size_t width = (x1 - pixels.x) * 4;
+	int y0 = pixels.y;
+	if (dy < 0) {
+		for (int y = y0; y < y1 + dy; y++) {
+			memmove(data + y * stride + x,
+				data + (y - dy) * stride + x, width);
+		}
+	} else {
+		for (int y = y1 - 1; y >= y0 + dy; y--) {
+			memmove(data + y * stride + x,
+				data + (y - dy) * stride + x, width);
+		}
 	}
+	cairo_surface_mark_dirty(buffer->surface);
 
-	struct seat *seat, *tmpseat;
-	wl_list_for_each_safe(seat, tmpseat, &nag->seats, link) {
-		seat_destroy(seat);
+	/* Only the strip the text moved away from needs drawing */
+	struct display_rect strip = { view.x, view.y, view.width, exposed };
+	if (shift > 0) {
+		strip.y += view.height - exposed;
 	}
+	repaint->nr_rects = 0;
+	display_damage_add(repaint, strip, list);
+	return true;
+}
 
-	destroy_buffer(&nag->buffers[0]);
-	destroy_buffer(&nag->buffers[1]);
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct nag *nag = data;
+	wl_callback_destroy(callback);
+	nag->frame_callback = NULL;
+}
 
-	if (nag->outputs.prev || nag->outputs.next) {
-		struct output *output, *temp;
-		wl_list_for_each_safe(output, temp, &nag->outputs, link) {
-			wl_output_destroy(output->wl_output);
-			free(output->name);
-			wl_list_remove(&output->link);
-			free(output);
-		};
-	}
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done,
+};
 
-	if (nag->compositor) {
-		wl_compositor_destroy(nag->compositor);
-	}
+/*
+ * Mark the surface as needing a new frame. The frame is drawn from nag_run()
+ * once pending events have been dispatched and the compositor is ready for
+ * it, so a burst of state changes results in a single render.
+ */
+static void
+schedule_frame(struct nag *nag)
+{
+	nag->dirty = true;
+}
 
-	if (nag->shm) {
-		wl_shm_destroy(nag->shm);
-	}
+static void
+buffer_released(void *data)
+{
+	struct nag *nag = data;
+	/* A frame which found all buffers busy can be drawn now */
+	nag->waiting_for_buffer = false;
+}
 
-	if (nag->display) {
-		wl_display_disconnect(nag->display);
-	}
-	pango_cairo_font_map_set_default(NULL);
+/* Request a new height; drawing waits for the matching configure */
+static void
+nag_set_size(struct nag *nag, uint32_t height)
+{
+	zwlr_layer_surface_v1_set_size(nag->layer_surface, 0, height);
+	/* Also reset, as --daemon may show the next message in the same bar */
+	zwlr_layer_surface_v1_set_exclusive_zone(nag->layer_surface,
+		nag->details.use_exclusive_zone ? height : 0);
+	wl_surface_commit(nag->surface);
+	nag->configure_pending = true;
+}
 
-	close_pollfd(&nag->pollfds[FD_TIMER]);
-	close_pollfd(&nag->pollfds[FD_SIGNAL]);
+/*
+ * Tell the compositor which parts of @panel are opaque, so that it can skip
+ * blending them and what is underneath. The region is only sent again when
+ * the opaque items change, which in practice means the layout did.
+ */
+static void
+update_opaque_region(struct nag *nag, struct panel *panel)
+{
+	const struct display_list *list = &panel->list;
+	const struct display_rect *area = &list->area;
+	bool xrgb = !panel->solid
+		&& panel->swapchain.format == WL_SHM_FORMAT_XRGB8888;
+	uint64_t key = display_hash(DISPLAY_HASH_INIT, &xrgb, sizeof(xrgb));
+	key = display_hash(key, area, sizeof(*area));
+	for (size_t i = 0; !xrgb && i < list->nr_items; i++) {
+		const struct display_item *item = &list->items[i];
+		bool opaque = (item->color & 0xFF) == 0xFF;
+		/* Anything drawn over an opaque pixel leaves it opaque */
+		if (item->type == DISPLAY_FILL
+				|| (item->type == DISPLAY_RECT && opaque)) {
+			key = display_hash(key, &item->box, sizeof(item->box));
+			key = display_hash(key, &opaque, sizeof(opaque));
+		}
+	}
+	if (key == panel->opaque_key) {
+		return;
+	}
+	panel->opaque_key = key;
+
+	/* In surface coordinates of the panel */
+	struct wl_region *region = wl_compositor_create_region(nag->compositor);
+	if (xrgb) {
+		/* The buffers have no alpha channel */
+		wl_region_add(region, 0, 0, area->width, area->height);
+	}
+	for (size_t i = 0; !xrgb && i < list->nr_items; i++) {
+		const struct display_item *item = &list->items[i];
+		const struct display_rect *box = &item->box;
+		if ((item->color & 0xFF) == 0xFF) {
+			if (item->type == DISPLAY_FILL
+					|| item->type == DISPLAY_RECT) {
+				wl_region_add(region, box->x - area->x,
+					box->y - area->y, box->width,
+					box->height);
+			}
+		} else if (item->type == DISPLAY_FILL) {
+			/* Fills replace what is underneath */
+			wl_region_subtract(region, box->x - area->x,
+				box->y - area->y, box->width, box->height);
+		}
+	}
+	wl_surface_set_opaque_region(panel->surface, region);
+	wl_region_destroy(region);
+}
+
+/*
+ * Take a buffer for every panel which has to be drawn. If one of them has
+ * none to spare, give the others back so that the frame stays whole.
+ */
+static bool
+acquire_buffers(struct nag *nag)
+{
+	for (int i = 0; i < NR_PANELS; i++) {
+		struct panel *panel = &nag->panels[i];
+		const struct display_rect *area = &panel->list.area;
+		panel->buffer = NULL;
+		if (!panel->changed || panel->solid || !area->width) {
+			continue;
+		}
+
+		struct swapchain *chain = &panel->swapchain;
+		unsigned int nr_stalls = chain->nr_stalls;
+		panel->buffer = get_next_buffer(chain,
+			lround(area->width * nag->scale),
+			lround(area->height * nag->scale));
+		if (panel->buffer) {
+			continue;
+		}
+		if (chain->nr_stalls != nr_stalls) {
+			/* Still dirty, so drawn once a buffer is released */
+			wlr_log(WLR_DEBUG, "All buffers busy (%u stalls)",
+				chain->nr_stalls);
+			nag->waiting_for_buffer = true;
+		} else {
+			wlr_log(WLR_DEBUG, "Failed to get buffer. Skipping frame.");
+		}
+		for (int j = 0; j < i; j++) {
+			if (nag->panels[j].buffer) {
+				swapchain_cancel(nag->panels[j].buffer);
+				nag->panels[j].buffer = NULL;
+			}
+		}
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Update the surface of @panel. Synchronized subsurfaces apply with the
+ * next commit of the bar.
+ */
+static void
+present_panel(struct nag *nag, struct panel *panel)
+{
+	const struct display_list *list = &panel->list;
+	const struct display_rect *area = &list->area;
+
+	if (!area->width) {
+		wl_surface_attach(panel->surface, NULL, 0, 0);
+	} else if (panel->solid) {
+		wl_surface_attach(panel->surface, panel->solid, 0, 0);
+		wl_surface_damage_buffer(panel->surface, 0, 0, 1, 1);
+		wp_viewport_set_destination(panel->viewport, area->width,
+			area->height);
+	} else {
+		/* The buffer may still hold an older frame than the committed one */
+		struct pool_buffer *buffer = panel->buffer;
+		struct display_list *contents =
+			&panel->buffer_lists[buffer - panel->swapchain.buffers];
+		struct display_damage repaint;
+		if (!scroll_details(nag, buffer, list, contents, &repaint)) {
+			display_list_diff(list, contents, &repaint);
+		}
+		if (repaint.nr_rects) {
+			draw_list(buffer->cairo, nag, list, &repaint);
+		}
+		cairo_surface_flush(buffer->surface);
+		display_list_copy(contents, list);
+
+		if (panel->viewport) {
+			wp_viewport_set_destination(panel->viewport,
+				area->width, area->height);
+		} else {
+			wl_surface_set_buffer_scale(panel->surface,
+				nag->output_scale);
+		}
+		wl_surface_attach(panel->surface, buffer->buffer, 0, 0);
+		for (int i = 0; i < panel->damage.nr_rects; i++) {
+			struct display_rect r =
+				display_list_pixels(list, panel->damage.rects[i]);
+			wl_surface_damage_buffer(panel->surface, r.x, r.y,
+				r.width, r.height);
+		}
+	}
+
+	const struct display_rect *old = &panel->committed_list.area;
+	if (panel->subsurface && (area->x != old->x || area->y != old->y)) {
+		wl_subsurface_set_position(panel->subsurface, area->x,
+			area->y);
+	}
+	update_opaque_region(nag, panel);
+	display_list_copy(&panel->committed_list, list);
+	if (panel->subsurface) {
+		wl_surface_commit(panel->surface);
+	}
+}
+
+static void
+render_frame(struct nag *nag)
+{
+	if (!nag->run_display) {
+		return;
+	}
+
+	uint32_t height = nag_layout(nag);
+	if (height != nag->height) {
+		nag_set_size(nag, height);
+		return;
+	}
+
+	int nr_changed = 0;
+	for (int i = 0; i < NR_PANELS; i++) {
+		struct panel *panel = &nag->panels[i];
+		if (!panel->surface) {
+			continue;
+		}
+		render_panel(&panel->list, nag, i);
+		panel->changed = display_list_diff(&panel->list,
+			&panel->committed_list, &panel->damage);
+		nr_changed += panel->changed;
+	}
+	if (!nr_changed) {
+		/* Nothing visible changed */
+		nag->dirty = false;
+		return;
+	}
+
+	if (!acquire_buffers(nag)) {
+		return;
+	}
+
+	/*
+	 * The details are a desynchronized subsurface, so scrolling them or
+	 * adding text commits just that. Only a move needs the bar to commit.
+	 */
+	struct panel *details = &nag->panels[PANEL_DETAILS];
+	const struct display_rect *area = &details->list.area;
+	const struct display_rect *old = &details->committed_list.area;
+	if (nr_changed == 1 && details->changed
+			&& area->x == old->x && area->y == old->y) {
+		nag->frame_callback = wl_surface_frame(details->surface);
+		wl_callback_add_listener(nag->frame_callback, &frame_listener,
+			nag);
+		present_panel(nag, details);
+		nag->dirty = false;
+		return;
+	}
+
+	/* Otherwise all panels change at once, with the bar */
+	wl_subsurface_set_sync(details->subsurface);
+	for (int i = 0; i < NR_PANELS; i++) {
+		if (nag->panels[i].changed) {
+			present_panel(nag, &nag->panels[i]);
+		}
+	}
+	nag->frame_callback = wl_surface_frame(nag->surface);
+	wl_callback_add_listener(nag->frame_callback, &frame_listener, nag);
+	wl_surface_commit(nag->surface);
+	wl_subsurface_set_desync(details->subsurface);
+	nag->dirty = false;
+}
+
+static bool
+details_at_end(struct nag *nag)
+{
+	return nag->details.pos.paragraph == nag->details.end.paragraph
+		&& nag->details.pos.line == nag->details.end.line;
+}
+
+/*
+ * Scroll the details by @pixels. What does not add up to a whole device
+ * pixel is kept for the next call, so that the text stays on the pixel
+ * grid and can be moved within the buffer instead of being redrawn.
+ */
+static void
+details_scroll_pixels(struct nag *nag, double pixels)
+{
+	pixels += nag->details.scroll_remainder;
+	int device = pixels * nag->scale;
+	nag->details.scroll_remainder = pixels - (double)device / nag->scale;
+	if (!device) {
+		return;
+	}
+
+	int moved = details_model_scroll_by(&nag->details.model,
+		&nag->details.pos, &nag->details.offset,
+		lround(device * PANGO_SCALE / nag->scale), &nag->details.end);
+	if (moved == 0) {
+		nag->details.scroll_remainder = 0;
+		return;
+	}
+	if (moved < 0) {
+		nag->details.follow_bottom = false;
+	}
+	schedule_frame(nag);
+}
+
+static void
+kinetic_scroll_start(struct nag *nag, double velocity)
+{
+	if (velocity > -KINETIC_MIN_VELOCITY && velocity < KINETIC_MIN_VELOCITY) {
+		return;
+	}
+	nag->details.velocity = velocity;
+	struct itimerspec interval = {
+		.it_interval.tv_nsec = KINETIC_INTERVAL_MS * 1000000,
+		.it_value.tv_nsec = KINETIC_INTERVAL_MS * 1000000,
+	};
+	timerfd_settime(nag->pollfds[FD_SCROLL].fd, 0, &interval, NULL);
+}
+
+static void
+kinetic_scroll_stop(struct nag *nag)
+{
+	if (nag->details.velocity == 0) {
+		return;
+	}
+	nag->details.velocity = 0;
+	struct itimerspec disarm = { 0 };
+	timerfd_settime(nag->pollfds[FD_SCROLL].fd, 0, &disarm, NULL);
+}
+
+/* Scroll to the start of the previous or next line */
+static void
+details_scroll_line(struct nag *nag, int direction)
+{
+	struct details_model *model = &nag->details.model;
+	struct details_pos *pos = &nag->details.pos;
+
+	kinetic_scroll_stop(nag);
+	nag->details.scroll_remainder = 0;
+
+	int delta;
+	if (direction < 0) {
+		delta = -nag->details.offset;
+		struct details_pos prev = *pos;
+		if (!delta && details_model_scroll(model, &prev, -1)) {
+			delta = -details_model_span(model, &prev, 1);
+		}
+		nag->details.follow_bottom = false;
+	} else {
+		delta = details_model_span(model, pos, 1) - nag->details.offset;
+	}
+	details_model_scroll_by(model, pos, &nag->details.offset, delta,
+		&nag->details.end);
+	schedule_frame(nag);
+}
+
+/* Keep scrolling after the fingers were lifted, slowing down */
+static void
+handle_kinetic_scroll(struct nag *nag)
+{
+	uint64_t expirations;
+	if (read(nag->pollfds[FD_SCROLL].fd, &expirations,
+			sizeof(expirations)) != sizeof(expirations)) {
+		return;
+	}
+
+	double pixels = 0;
+	for (uint64_t i = 0; i < expirations; i++) {
+		pixels += nag->details.velocity * KINETIC_INTERVAL_MS / 1000;
+		nag->details.velocity *= KINETIC_FRICTION;
+	}
+	details_scroll_pixels(nag, pixels);
+
+	double velocity = nag->details.velocity;
+	if (!nag->details.visible
+			|| (velocity < 0 && details_at_top(nag))
+			|| (velocity > 0 && details_at_end(nag))
+			|| (velocity > -KINETIC_MIN_VELOCITY
+				&& velocity < KINETIC_MIN_VELOCITY)) {
+		kinetic_scroll_stop(nag);
+	}
+}
+
+/*
+ * Returns the cursor theme for @size, loading it on first use. Themes which
+ * failed to load are remembered too, so that they are not tried again on
+ * every pointer enter.
+ */
+static struct wl_cursor_theme *
+get_cursor_theme(struct nag *nag, int size)
+{
+	struct cursor_theme *entry;
+	wl_list_for_each(entry, &nag->cursor_themes, link) {
+		if (entry->size == size
+				&& g_strcmp0(entry->name, nag->cursor_theme_name) == 0) {
+			return entry->theme;
+		}
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		perror("calloc");
+		return NULL;
+	}
+	entry->name = nag->cursor_theme_name;
+	entry->size = size;
+	entry->theme = wl_cursor_theme_load(entry->name, size, nag->shm);
+	if (!entry->theme) {
+		wlr_log(WLR_ERROR, "Failed to load cursor theme");
+	}
+	wl_list_insert(&nag->cursor_themes, &entry->link);
+	return entry->theme;
+}
+
+static void
+cursor_themes_finish(struct nag *nag)
+{
+	struct cursor_theme *entry, *next;
+	wl_list_for_each_safe(entry, next, &nag->cursor_themes, link) {
+		if (entry->theme) {
+			wl_cursor_theme_destroy(entry->theme);
+		}
+		wl_list_remove(&entry->link);
+		free(entry);
+	}
+}
+
+static void
+seat_destroy(struct seat *seat)
+{
+	if (seat->pointer.pointer) {
+		wl_pointer_destroy(seat->pointer.pointer);
+	}
+	if (seat->pointer.cursor_surface) {
+		wl_surface_destroy(seat->pointer.cursor_surface);
+	}
+	wl_seat_destroy(seat->wl_seat);
+	wl_list_remove(&seat->link);
+	free(seat);
+}
+
+static void
+output_destroy(struct output *output)
+{
+	wl_output_destroy(output->wl_output);
+	free(output->name);
+	wl_list_remove(&output->link);
+	free(output);
+}
+
+static void
+panel_finish(struct panel *panel)
+{
+	if (panel->swapchain.pool.shm) {
+		if (panel->swapchain.nr_stalls) {
+			wlr_log(WLR_DEBUG, "Stalled %u times on busy buffers",
+				panel->swapchain.nr_stalls);
+		}
+		swapchain_finish(&panel->swapchain);
+	}
+	display_list_finish(&panel->list);
+	for (size_t i = 0; i < SWAPCHAIN_MAX_BUFFERS; i++) {
+		display_list_finish(&panel->buffer_lists[i]);
+	}
+	display_list_finish(&panel->committed_list);
+
+	if (panel->solid) {
+		wl_buffer_destroy(panel->solid);
+	}
+	if (panel->viewport) {
+		wp_viewport_destroy(panel->viewport);
+	}
+	if (panel->subsurface) {
+		wl_subsurface_destroy(panel->subsurface);
+		wl_surface_destroy(panel->surface);
+	}
+	*panel = (struct panel){ 0 };
+}
+
+static void
+free_buttons(struct wl_list *buttons)
+{
+	struct button *button, *next;
+	wl_list_for_each_safe(button, next, buttons, link) {
+		wl_list_remove(&button->link);
+		free(button);
+	}
+}
+
+/* Forget the message shown, but keep the bar */
+static void
+nag_clear_message(struct nag *nag)
+{
+	free_buttons(&nag->buttons);
+	details_model_finish(&nag->details.model);
+	g_free(nag->details.loading_text);
+	nag->details.loading_text = NULL;
+	free(nag->details.message);
+	nag->details.message = NULL;
+	if (nag->details.mapping) {
+		munmap(nag->details.mapping, nag->details.mapping_size);
+		nag->details.mapping = NULL;
+	}
+	if (nag->details.reading) {
+		size_t len;
+		free(details_reader_finish(&nag->details.reader, &len));
+		nag->details.reading = false;
+	}
+	pango_font_description_free(nag->conf->font_description);
+	nag->conf->font_description = NULL;
+	nag->message = NULL;
+	free(nag->control.message);
+	nag->control.message = NULL;
+	free(nag->control.details);
+	nag->control.details = NULL;
+	nag->control.details_len = 0;
+	nag->control.len = 0;
+	nag->control.skip_line = false;
+
+	kinetic_scroll_stop(nag);
+	close_pollfd(&nag->pollfds[FD_TIMER]);
+	close_nonblock(&nag->pollfds[FD_STDIN], nag->details.stdin_flags);
+	close_nonblock(&nag->pollfds[FD_CONTROL], nag->control.flags);
+}
+
+static void
+nag_hide(struct nag *nag)
+{
+	if (nag->frame_callback) {
+		wl_callback_destroy(nag->frame_callback);
+		nag->frame_callback = NULL;
+	}
+
+	if (nag->layer_surface) {
+		zwlr_layer_surface_v1_destroy(nag->layer_surface);
+		nag->layer_surface = NULL;
+	}
+
+	for (size_t i = 0; i < NR_PANELS; i++) {
+		panel_finish(&nag->panels[i]);
+	}
+
+	if (nag->fractional_scale) {
+		wp_fractional_scale_v1_destroy(nag->fractional_scale);
+		nag->fractional_scale = NULL;
+	}
+
+	if (nag->surface) {
+		wl_surface_destroy(nag->surface);
+		nag->surface = NULL;
+	}
+	nag->output = NULL;
+	nag->width = 0;
+	nag->height = 0;
+	nag->dirty = false;
+	nag->configure_pending = false;
+	nag->waiting_for_buffer = false;
+	nag->closed = false;
+}
+
+/* Take down the bar and forget the message it showed */
+static void
+nag_close(struct nag *nag)
+{
+	nag->run_display = false;
+	nag_clear_message(nag);
+	nag_hide(nag);
+}
+
+static void
+nag_destroy(struct nag *nag)
+{
+	nag_close(nag);
+	ipc_request_finish(&nag->handoff);
+
+	layout_cache_clear(nag);
+	if (nag->pango) {
+		g_object_unref(nag->pango);
+		nag->pango = NULL;
+	}
+	if (nag->measure_cairo) {
+		cairo_destroy(nag->measure_cairo);
+		cairo_surface_destroy(nag->measure_surface);
+		nag->measure_cairo = NULL;
+		nag->measure_surface = NULL;
+	}
+
+	if (nag->layer_shell) {
+		zwlr_layer_shell_v1_destroy(nag->layer_shell);
+	}
+
+	if (nag->cursor_shape_manager) {
+		wp_cursor_shape_manager_v1_destroy(nag->cursor_shape_manager);
+	}
+
+	if (nag->fractional_scale_manager) {
+		wp_fractional_scale_manager_v1_destroy(
+			nag->fractional_scale_manager);
+	}
+
+	if (nag->viewporter) {
+		wp_viewporter_destroy(nag->viewporter);
+	}
+
+	if (nag->single_pixel_manager) {
+		wp_single_pixel_buffer_manager_v1_destroy(
+			nag->single_pixel_manager);
+	}
+
+	if (nag->subcompositor) {
+		wl_subcompositor_destroy(nag->subcompositor);
+	}
+
+	struct seat *seat, *tmpseat;
+	wl_list_for_each_safe(seat, tmpseat, &nag->seats, link) {
+		seat_destroy(seat);
+	}
+	if (nag->cursor_themes.next) {
+		cursor_themes_finish(nag);
+	}
+
+	if (nag->outputs.prev || nag->outputs.next) {
+		struct output *output, *temp;
+		wl_list_for_each_safe(output, temp, &nag->outputs, link) {
+			output_destroy(output);
+		};
+	}
+
+	if (nag->compositor) {
+		wl_compositor_destroy(nag->compositor);
+	}
+
+	if (nag->shm) {
+		wl_shm_destroy(nag->shm);
+	}
+
+	if (nag->registry) {
+		wl_registry_destroy(nag->registry);
+	}
+
+	if (nag->display) {
+		wl_display_disconnect(nag->display);
+	}
+	pango_cairo_font_map_set_default(NULL);
+
+	close_pollfd(&nag->pollfds[FD_SIGNAL]);
+	close_pollfd(&nag->pollfds[FD_SCROLL]);
+	for (size_t i = 0; i < PENDING_REQUESTS; i++) {
+		if (nag->pollfds[FD_PENDING + i].fd >= 0) {
+			ipc_reader_finish(&nag->pending[i]);
+			close_pollfd(&nag->pollfds[FD_PENDING + i]);
+		}
+	}
+}
+
+static void
+run_action(const char *action)
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		wlr_log_errno(WLR_DEBUG, "Failed to fork");
+		return;
+	} else if (pid == 0) {
+		/*
+		 * Child process. Will be used to prevent zombie
+		 * processes
+		 */
+		pid = fork();
+		if (pid < 0) {
+			wlr_log_errno(WLR_DEBUG, "Failed to fork");
+			return;
+		} else if (pid == 0) {
+			/*
+			 * Child of the child. Will be reparented to the
+			 * init process
+			 */
+			execlp("sh", "sh", "-c", action, NULL);
+			wlr_log_errno(WLR_DEBUG, "execlp failed");
+			_exit(LAB_EXIT_FAILURE);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, NULL, 0) < 0) {
+		wlr_log_errno(WLR_DEBUG, "waitpid failed");
+	}
+}
+
+static void
+button_execute(struct nag *nag, struct button *button)
+{
+	wlr_log(WLR_DEBUG, "Executing [%s]: %s", button->text, button->action);
+	if (button->expand && nag->details.reading && !nag->details.follow) {
+		/* Still loading */
+		return;
+	}
+	if (button->expand) {
+		nag->details.visible = !nag->details.visible;
+		schedule_frame(nag);
+		return;
+	}
+	if (button->dismiss) {
+		nag->run_display = false;
+	}
+	if (button->action) {
+		run_action(button->action);
+	}
+}
+
+/* Reply to everyone waiting for @entry and drop it */
+static void
+queued_finish(struct queued *entry)
+{
+	for (size_t i = 0; i < entry->nr_clients; i++) {
+		ipc_send_reply(entry->clients[i], entry->status);
+		close(entry->clients[i]);
+	}
+	free(entry->clients);
+	free_buttons(&entry->buttons);
+	ipc_request_finish(&entry->request);
+	wl_list_remove(&entry->link);
+	free(entry);
+}
+
+/* Forget the clients which went away, returns whether any are left */
+static bool
+queued_prune(struct queued *entry)
+{
+	size_t nr_clients = 0;
+	for (size_t i = 0; i < entry->nr_clients; i++) {
+		struct pollfd pollfd = { .fd = entry->clients[i] };
+		if (poll(&pollfd, 1, 0) > 0
+				&& pollfd.revents & (POLLHUP | POLLERR)) {
+			close(entry->clients[i]);
+		} else {
+			entry->clients[nr_clients++] = entry->clients[i];
+		}
+	}
+	entry->nr_clients = nr_clients;
+	return nr_clients > 0;
+}
+
+static void
+queued_button_execute(struct nag *nag, struct queued *entry,
+		struct button *button, int index)
+{
+	wlr_log(WLR_DEBUG, "Executing [%s]: %s", button->text, button->action);
+	entry->status = index;
+	if (button->action) {
+		run_action(button->action);
+	}
+	if (button->dismiss) {
+		queued_finish(entry);
+		schedule_frame(nag);
+	}
+}
+
+/*
+ * Parse the options of @entry ahead of showing it, for the message and the
+ * buttons it is stacked with. Details are not read until it is shown.
+ */
+static bool
+queued_parse(struct queued *entry)
+{
+	struct conf conf;
+	struct nag scratch = { 0 };
+	nag_init_message(&scratch, &conf);
+	bool debug;
+	int status = nag_parse_options(entry->request.argc,
+		entry->request.argv, &scratch, &conf, &debug);
+	pango_font_description_free(conf.font_description);
+
+	wl_list_insert_list(&entry->buttons, &scratch.buttons);
+	entry->message = scratch.message;
+	entry->tag = scratch.tag;
+	return status != LAB_EXIT_FAILURE && entry->message;
+}
+
+/* Identical arguments, working directory and stdin make the same message */
+static uint64_t
+request_key(const struct ipc_request *request)
+{
+	uint64_t key = display_hash(DISPLAY_HASH_INIT, request->buffer,
+		request->size);
+	struct stat st;
+	if (request->stdin_fd >= 0 && fstat(request->stdin_fd, &st) == 0) {
+		key = display_hash(key, &st.st_dev, sizeof(st.st_dev));
+		key = display_hash(key, &st.st_ino, sizeof(st.st_ino));
+	}
+	return key;
+}
+
+/* Exchange the messages of @a and @b, but not who waits for them */
+static void
+queued_swap(struct queued *a, struct queued *b)
+{
+	struct queued tmp = *a;
+	a->request = b->request;
+	a->key = b->key;
+	a->message = b->message;
+	a->tag = b->tag;
+	b->request = tmp.request;
+	b->key = tmp.key;
+	b->message = tmp.message;
+	b->tag = tmp.tag;
+
+	struct wl_list buttons;
+	wl_list_init(&buttons);
+	wl_list_insert_list(&buttons, &a->buttons);
+	wl_list_init(&a->buttons);
+	wl_list_insert_list(&a->buttons, &b->buttons);
+	wl_list_init(&b->buttons);
+	wl_list_insert_list(&b->buttons, &buttons);
+}
+
+/*
+ * Move the message of @entry to the one queued with the same --replace tag,
+ * which keeps its place and its clients. @entry is left with the old message.
+ * Returns false if there is none.
+ */
+static bool
+queued_replace(struct nag *nag, struct queued *entry)
+{
+	struct queued *other;
+	wl_list_for_each(other, &nag->queue, link) {
+		if (other != entry && g_strcmp0(other->tag, entry->tag) == 0) {
+			break;
+		}
+	}
+	if (&other->link == &nag->queue) {
+		return false;
+	}
+
+	bool shown = other->link.prev == &nag->queue;
+	if (shown) {
+		if (!nag->run_display) {
+			/* Already dismissed, so it is shown after instead */
+			return false;
+		}
+		if (!nag_replace_message(nag, &entry->request)) {
+			entry->status = LAB_EXIT_FAILURE;
+		}
+	}
+	queued_swap(other, entry);
+	if (shown) {
+		/* Only the stacked ones are parsed ahead */
+		free_buttons(&other->buttons);
+		other->message = NULL;
+	}
+	return true;
+}
+
+static void
+queue_request(struct nag *nag, int fd, struct ipc_request request)
+{
+	struct queued *entry;
+	bool replaced = false;
+	uint64_t key = request_key(&request);
+	wl_list_for_each(entry, &nag->queue, link) {
+		if (entry->key == key && entry->request.size == request.size
+				&& !memcmp(entry->request.buffer, request.buffer,
+					request.size)) {
+			break;
+		}
+	}
+	if (&entry->link == &nag->queue) {
+		entry = calloc(1, sizeof(*entry));
+		if (!entry) {
+			perror("calloc");
+			ipc_request_finish(&request);
+			close(fd);
+			return;
+		}
+		entry->request = request;
+		entry->key = key;
+		entry->status = LAB_EXIT_SUCCESS;
+		wl_list_init(&entry->buttons);
+		wl_list_insert(nag->queue.prev, &entry->link);
+		if (!queued_parse(entry)) {
+			entry->status = LAB_EXIT_FAILURE;
+		} else if (entry->tag) {
+			replaced = queued_replace(nag, entry);
+		}
+	} else {
+		ipc_request_finish(&request);
+	}
+
+	int *clients = realloc(entry->clients,
+		(entry->nr_clients + 1) * sizeof(*clients));
+	if (!clients) {
+		perror("realloc");
+		close(fd);
+	} else {
+		entry->clients = clients;
+		entry->clients[entry->nr_clients++] = fd;
+	}
+
+	/* Those replacing a message are done once it is replaced */
+	if (replaced || entry->status == LAB_EXIT_FAILURE
+			|| !entry->nr_clients) {
+		queued_finish(entry);
+	}
+}
+
+/* Without --daemon, requests come from --replace with the same tag */
+static void
+handoff_request(struct nag *nag, int fd, struct ipc_request request)
+{
+	/* The previous one is still compared with, and freed after */
+	struct ipc_request previous = nag->handoff;
+	nag->handoff = request;
+	bool replaced = nag_replace_message(nag, &nag->handoff);
+	ipc_request_finish(&previous);
+
+	ipc_send_reply(fd, replaced ? LAB_EXIT_SUCCESS : LAB_EXIT_FAILURE);
+	close(fd);
+}
+
+/* How long poll() may wait for the requests being received, or -1 */
+static int
+requests_timeout(struct nag *nag)
+{
+	int timeout = -1;
+	for (size_t i = 0; i < PENDING_REQUESTS; i++) {
+		if (nag->pollfds[FD_PENDING + i].fd < 0) {
+			continue;
+		}
+		int left = ipc_reader_timeout(&nag->pending[i]);
+		if (timeout < 0 || left < timeout) {
+			timeout = left;
+		}
+	}
+	return timeout;
+}
+
+/* Also wake up now and then to notice clients of stacked rows going away */
+static int
+run_timeout(struct nag *nag)
+{
+	int timeout = requests_timeout(nag);
+	struct queued *entry;
+	wl_list_for_each(entry, &nag->queue, link) {
+		if (entry->stacked) {
+			if (timeout < 0 || timeout > PRUNE_INTERVAL_MS) {
+				timeout = PRUNE_INTERVAL_MS;
+			}
+			break;
+		}
+	}
+	return timeout;
+}
+
+/* Take the stacked rows of clients which went away off the bar */
+static void
+prune_stacked(struct nag *nag)
+{
+	struct queued *entry;
+	wl_list_for_each(entry, &nag->queue, link) {
+		if (entry->stacked && !queued_prune(entry)) {
+			schedule_frame(nag);
+		}
+	}
+}
+
+static void
+close_request(struct nag *nag, size_t i)
+{
+	ipc_reader_finish(&nag->pending[i]);
+	close_pollfd(&nag->pollfds[FD_PENDING + i]);
+}
+
+/*
+ * Accept connections while there is room, and receive their requests as
+ * the bytes come in. The requests complete by then are taken all at once,
+ * so that a burst is laid out once.
+ */
+static void
+handle_requests(struct nag *nag)
+{
+	bool accept = nag->pollfds[FD_LISTEN].revents & POLLIN;
+	bool taken = false;
+	bool room = false;
+	for (size_t i = 0; i < PENDING_REQUESTS; i++) {
+		struct pollfd *pollfd = &nag->pollfds[FD_PENDING + i];
+		struct ipc_reader *reader = &nag->pending[i];
+		if (pollfd->fd < 0 && accept) {
+			pollfd->fd = ipc_accept(nag->pollfds[FD_LISTEN].fd);
+			if (pollfd->fd < 0) {
+				accept = false;
+				room = true;
+				continue;
+			}
+			pollfd->events = POLLIN;
+			/* The request may well have arrived with it */
+			pollfd->revents = POLLIN;
+			ipc_reader_init(reader);
+		}
+		if (pollfd->fd < 0) {
+			room = true;
+			continue;
+		}
+
+		struct ipc_request request;
+		int status = 0;
+		if (pollfd->revents) {
+			status = ipc_reader_read(reader, pollfd->fd, &request);
+		}
+		if (status == 0 && ipc_reader_timeout(reader) == 0) {
+			wlr_log(WLR_ERROR, "Request timed out");
+			status = -1;
+		}
+		if (status < 0) {
+			close_request(nag, i);
+			room = true;
+		} else if (status > 0) {
+			/* The connection stays open for the reply */
+			int fd = pollfd->fd;
+			*pollfd = (struct pollfd){ .fd = -1 };
+			room = true;
+			taken = true;
+			if (nag->daemon) {
+				queue_request(nag, fd, request);
+			} else {
+				handoff_request(nag, fd, request);
+			}
+		}
+	}
+
+	/* The others wait in the backlog until there is room */
+	nag->pollfds[FD_LISTEN].events = room ? POLLIN : 0;
+	if (taken) {
+		schedule_frame(nag);
+	}
+}
+
+static void
+nag_set_scale(struct nag *nag, double scale)
+{
+	if (nag->scale == scale) {
+		return;
+	}
+	/* Layouts shaped for the old scale will never be hit again */
+	layout_cache_clear(nag);
+	nag->scale = scale;
 }
 
+/* The output scale is only drawn at if there is no fractional one */
 static void
-button_execute(struct nag *nag, struct button *button)
+nag_set_output_scale(struct nag *nag, int32_t scale)
 {
-	wlr_log(WLR_DEBUG, "Executing [%s]: %s", button->text, button->action);
-	if (button->expand) {
-		nag->details.visible = !nag->details.visible;
-		render_frame(nag);
-		return;
-	}
-	if (button->dismiss) {
-		nag->run_display = false;
+	nag->output_scale = scale;
+	if (!nag->fractional_scale) {
+		nag_set_scale(nag, scale);
 	}
-	if (button->action) {
-		pid_t pid = fork();
-		if (pid < 0) {
-			wlr_log_errno(WLR_DEBUG, "Failed to fork");
-			return;
-		} else if (pid == 0) {
-			/*
-			 * Child process. Will be used to prevent zombie
-			 * processes
-			 */
-			pid = fork();
-			if (pid < 0) {
-				wlr_log_errno(WLR_DEBUG, "Failed to fork");
-				return;
-			} else if (pid == 0) {
-				/*
-				 * Child of the child. Will be reparented to the
-				 * init process
-				 */
-				execlp("sh", "sh", "-c", button->action, NULL);
-				wlr_log_errno(WLR_DEBUG, "execlp failed");
-				_exit(LAB_EXIT_FAILURE);
-			}
-			_exit(EXIT_SUCCESS);
-		}
+}
 
-		if (waitpid(pid, NULL, 0) < 0) {
-			wlr_log_errno(WLR_DEBUG, "waitpid failed");
-		}
-	}
+static void
+fractional_scale_preferred_scale(void *data,
+		struct wp_fractional_scale_v1 *fractional_scale, uint32_t scale)
+{
+	struct nag *nag = data;
+	nag_set_scale(nag, scale / 120.0);
+	schedule_frame(nag);
 }
 
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = fractional_scale_preferred_scale,
+};
+
 static void
 layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
 		uint32_t serial, uint32_t width, uint32_t height)
@@ -683,14 +2225,16 @@ layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
 	nag->width = width;
 	nag->height = height;
 	zwlr_layer_surface_v1_ack_configure(surface, serial);
-	render_frame(nag);
+	nag->configure_pending = false;
+	schedule_frame(nag);
 }
 
 static void
 layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *surface)
 {
 	struct nag *nag = data;
-	nag_destroy(nag);
+	nag->closed = true;
+	nag->run_display = false;
 }
 
 static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
@@ -708,8 +2252,8 @@ surface_enter(void *data, struct wl_surface *surface, struct wl_output *output)
 			wlr_log(WLR_DEBUG, "Surface enter on output %s",
 					nag_output->name);
 			nag->output = nag_output;
-			nag->scale = nag->output->scale;
-			render_frame(nag);
+			nag_set_output_scale(nag, nag->output->scale);
+			schedule_frame(nag);
 			break;
 		}
 	}
@@ -731,44 +2275,39 @@ update_cursor(struct seat *seat)
 {
 	struct pointer *pointer = &seat->pointer;
 	struct nag *nag = seat->nag;
-	if (pointer->cursor_theme) {
-		wl_cursor_theme_destroy(pointer->cursor_theme);
-	}
-	const char *cursor_theme = getenv("XCURSOR_THEME");
-	unsigned int cursor_size = 24;
-	const char *env_cursor_size = getenv("XCURSOR_SIZE");
-	if (env_cursor_size && *env_cursor_size) {
-		errno = 0;
-		char *end;
-		unsigned int size = strtoul(env_cursor_size, &end, 10);
-		if (!*end && errno == 0) {
-			cursor_size = size;
-		}
+	if (!pointer->cursor_surface) {
+		pointer->cursor_surface =
+			wl_compositor_create_surface(nag->compositor);
 	}
-	pointer->cursor_theme = wl_cursor_theme_load(
-		cursor_theme, cursor_size * nag->scale, nag->shm);
-	if (!pointer->cursor_theme) {
-		wlr_log(WLR_ERROR, "Failed to load cursor theme");
+	struct wl_cursor_theme *theme = get_cursor_theme(nag,
+		nag->cursor_size * nag->output_scale);
+	if (!theme) {
 		return;
 	}
-	struct wl_cursor *cursor =
-		wl_cursor_theme_get_cursor(pointer->cursor_theme, "default");
-	if (!cursor) {
-		wlr_log(WLR_ERROR, "Failed to get default cursor from theme");
-		return;
+
+	/* The cursor surface only changes along with the scale */
+	if (theme != pointer->cursor_theme) {
+		struct wl_cursor *cursor =
+			wl_cursor_theme_get_cursor(theme, "default");
+		if (!cursor) {
+			wlr_log(WLR_ERROR, "Failed to get default cursor from theme");
+			return;
+		}
+		pointer->cursor_theme = theme;
+		pointer->cursor_image = cursor->images[0];
+		wl_surface_set_buffer_scale(pointer->cursor_surface,
+				nag->output_scale);
+		wl_surface_attach(pointer->cursor_surface,
+				wl_cursor_image_get_buffer(pointer->cursor_image),
+				0, 0);
+		wl_surface_damage_buffer(pointer->cursor_surface, 0, 0,
+				INT32_MAX, INT32_MAX);
+		wl_surface_commit(pointer->cursor_surface);
 	}
-	pointer->cursor_image = cursor->images[0];
-	wl_surface_set_buffer_scale(pointer->cursor_surface,
-			nag->scale);
-	wl_surface_attach(pointer->cursor_surface,
-			wl_cursor_image_get_buffer(pointer->cursor_image), 0, 0);
 	wl_pointer_set_cursor(pointer->pointer, pointer->serial,
 			pointer->cursor_surface,
-			pointer->cursor_image->hotspot_x / nag->scale,
-			pointer->cursor_image->hotspot_y / nag->scale);
-	wl_surface_damage_buffer(pointer->cursor_surface, 0, 0,
-			INT32_MAX, INT32_MAX);
-	wl_surface_commit(pointer->cursor_surface);
+			pointer->cursor_image->hotspot_x / nag->output_scale,
+			pointer->cursor_image->hotspot_y / nag->output_scale);
 }
 
 static void
@@ -822,6 +2361,14 @@ wl_pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time,
 	seat->pointer.y = wl_fixed_to_int(surface_y);
 }
 
+static bool
+button_contains(struct button *button, double x, double y)
+{
+	return x >= button->x && y >= button->y
+		&& x < button->x + button->width
+		&& y < button->y + button->height;
+}
+
 static void
 wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
 		uint32_t time, uint32_t button, uint32_t state)
@@ -839,10 +2386,7 @@ wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
 	int index = 0;
 	struct button *nagbutton;
 	wl_list_for_each(nagbutton, &nag->buttons, link) {
-		if (x >= nagbutton->x
-				&& y >= nagbutton->y
-				&& x < nagbutton->x + nagbutton->width
-				&& y < nagbutton->y + nagbutton->height) {
+		if (button_contains(nagbutton, x, y)) {
 			button_execute(nag, nagbutton);
 			exit_status = index;
 			return;
@@ -850,29 +2394,41 @@ wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
 		++index;
 	}
 
+	struct queued *entry;
+	wl_list_for_each(entry, &nag->queue, link) {
+		if (!entry->stacked) {
+			continue;
+		}
+		index = 0;
+		wl_list_for_each(nagbutton, &entry->buttons, link) {
+			if (button_contains(nagbutton, x, y)) {
+				queued_button_execute(nag, entry, nagbutton,
+					index);
+				return;
+			}
+			++index;
+		}
+	}
+
 	if (nag->details.visible &&
-			nag->details.total_lines != nag->details.visible_lines) {
+			(!details_at_top(nag) || nag->details.more)) {
 		struct button button_up = nag->details.button_up;
 		if (x >= button_up.x
 				&& y >= button_up.y
 				&& x < button_up.x + button_up.width
 				&& y < button_up.y + button_up.height
-				&& nag->details.offset > 0) {
-			nag->details.offset--;
-			render_frame(nag);
+				&& !details_at_top(nag)) {
+			details_scroll_line(nag, -1);
 			return;
 		}
 
 		struct button button_down = nag->details.button_down;
-		int bot = nag->details.total_lines;
-		bot -= nag->details.visible_lines;
 		if (x >= button_down.x
 				&& y >= button_down.y
 				&& x < button_down.x + button_down.width
 				&& y < button_down.y + button_down.height
-				&& nag->details.offset < bot) {
-			nag->details.offset++;
-			render_frame(nag);
+				&& nag->details.more) {
+			details_scroll_line(nag, 1);
 			return;
 		}
 	}
@@ -883,54 +2439,116 @@ wl_pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time,
 		uint32_t axis, wl_fixed_t value)
 {
 	struct seat *seat = data;
+	if (axis != WL_POINTER_AXIS_VERTICAL_SCROLL) {
+		return;
+	}
+	seat->pointer.scroll += wl_fixed_to_double(value);
+	seat->pointer.scroll_time = time;
+	seat->pointer.scrolled = true;
+}
+
+/* Apply the scrolling of one pointer frame */
+static void
+pointer_scroll(struct seat *seat)
+{
 	struct nag *nag = seat->nag;
+	struct pointer *pointer = &seat->pointer;
 	if (!nag->details.visible
-			|| seat->pointer.x < nag->details.x
-			|| seat->pointer.y < nag->details.y
-			|| seat->pointer.x >= nag->details.x + nag->details.width
-			|| seat->pointer.y >= nag->details.y + nag->details.height
-			|| nag->details.total_lines == nag->details.visible_lines) {
+			|| pointer->x < nag->details.x
+			|| pointer->y < nag->details.y
+			|| pointer->x >= nag->details.x + nag->details.width
+			|| pointer->y >= nag->details.y + nag->details.height
+			|| (details_at_top(nag) && !nag->details.more)) {
+		pointer->velocity = 0;
 		return;
 	}
 
-	int direction = wl_fixed_to_int(value);
-	int bot = nag->details.total_lines - nag->details.visible_lines;
-	if (direction < 0 && nag->details.offset > 0) {
-		nag->details.offset--;
-	} else if (direction > 0 && nag->details.offset < bot) {
-		nag->details.offset++;
+	bool finger = pointer->axis_source == WL_POINTER_AXIS_SOURCE_FINGER;
+	if (pointer->scrolled) {
+		double pixels = pointer->scroll;
+		if (pointer->scroll120) {
+			/* A notch scrolls a line, high-resolution wheels part of one */
+			int line = details_model_span(&nag->details.model,
+				&nag->details.pos, 1);
+			pixels = (double)pointer->scroll120 / 120
+				* line / PANGO_SCALE;
+		}
+		if (finger) {
+			/* Smooth the speed over the last few events */
+			uint32_t dt = pointer->scroll_time
+				- pointer->last_scroll_time;
+			double speed = dt > 0 && dt < 100 ? pixels * 1000 / dt : 0;
+			pointer->velocity = pointer->velocity * 0.4 + speed * 0.6;
+			pointer->last_scroll_time = pointer->scroll_time;
+		}
+		kinetic_scroll_stop(nag);
+		details_scroll_pixels(nag, pixels);
 	}
 
-	render_frame(nag);
+	if (pointer->scroll_stop && finger) {
+		/* Only fling if the fingers were still moving when lifted */
+		if (pointer->stop_time - pointer->last_scroll_time < 50) {
+			kinetic_scroll_start(nag, pointer->velocity);
+		}
+		pointer->velocity = 0;
+	}
 }
 
 static void
 wl_pointer_frame(void *data, struct wl_pointer *wl_pointer)
 {
 	struct seat *seat = data;
+	struct pointer *pointer = &seat->pointer;
 	/* pointer inputs clears timer for auto-closing */
 	close_pollfd(&seat->nag->pollfds[FD_TIMER]);
+
+	if (pointer->scrolled || pointer->scroll_stop) {
+		pointer_scroll(seat);
+	}
+	pointer->scroll = 0;
+	pointer->scroll120 = 0;
+	pointer->scrolled = false;
+	pointer->scroll_stop = false;
 }
 
 static void
 wl_pointer_axis_source(void *data, struct wl_pointer *wl_pointer,
 		uint32_t axis_source)
 {
-	/* nop */
+	struct seat *seat = data;
+	seat->pointer.axis_source = axis_source;
 }
 
 static void
 wl_pointer_axis_stop(void *data, struct wl_pointer *wl_pointer,
 		uint32_t time, uint32_t axis)
 {
-	/* nop */
+	struct seat *seat = data;
+	if (axis == WL_POINTER_AXIS_VERTICAL_SCROLL) {
+		seat->pointer.scroll_stop = true;
+		seat->pointer.stop_time = time;
+	}
 }
 
 static void
 wl_pointer_axis_discrete(void *data, struct wl_pointer *wl_pointer,
 		uint32_t axis, int32_t discrete)
 {
-	/* nop */
+	/* Only sent before wl_seat version 8 */
+	struct seat *seat = data;
+	if (axis == WL_POINTER_AXIS_VERTICAL_SCROLL) {
+		seat->pointer.scroll120 += discrete * 120;
+	}
+}
+
+static void
+wl_pointer_axis_value120(void *data, struct wl_pointer *wl_pointer,
+		uint32_t axis, int32_t value120)
+{
+	struct seat *seat = data;
+	if (axis == WL_POINTER_AXIS_VERTICAL_SCROLL) {
+		seat->pointer.scroll120 += value120;
+	}
 }
 
 static const struct wl_pointer_listener pointer_listener = {
@@ -943,6 +2561,7 @@ static const struct wl_pointer_listener pointer_listener = {
 	.axis_source = wl_pointer_axis_source,
 	.axis_stop = wl_pointer_axis_stop,
 	.axis_discrete = wl_pointer_axis_discrete,
+	.axis_value120 = wl_pointer_axis_value120,
 };
 
 static void
@@ -998,13 +2617,16 @@ static void
 output_scale(void *data, struct wl_output *output, int32_t factor)
 {
 	struct output *nag_output = data;
+	struct nag *nag = nag_output->nag;
 	nag_output->scale = factor;
-	if (nag_output->nag->output == nag_output) {
-		nag_output->nag->scale = nag_output->scale;
-		if (!nag_output->nag->cursor_shape_manager) {
-			update_all_cursors(nag_output->nag);
+	if (nag->output == nag_output) {
+		int32_t old_scale = nag->output_scale;
+		nag_set_output_scale(nag, nag_output->scale);
+		if (!nag->cursor_shape_manager
+				&& nag->output_scale != old_scale) {
+			update_all_cursors(nag);
 		}
-		render_frame(nag_output->nag);
+		schedule_frame(nag);
 	}
 }
 
@@ -1046,6 +2668,9 @@ handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	if (strcmp(interface, wl_compositor_interface.name) == 0) {
 		nag->compositor = wl_registry_bind(registry, name,
 				&wl_compositor_interface, 4);
+	} else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+		nag->subcompositor = wl_registry_bind(registry, name,
+				&wl_subcompositor_interface, 1);
 	} else if (strcmp(interface, wl_seat_interface.name) == 0) {
 		struct seat *seat = calloc(1, sizeof(*seat));
 		if (!seat) {
@@ -1056,7 +2681,8 @@ handle_global(void *data, struct wl_registry *registry, uint32_t name,
 		seat->nag = nag;
 		seat->wl_name = name;
 		seat->wl_seat =
-			wl_registry_bind(registry, name, &wl_seat_interface, 5);
+			wl_registry_bind(registry, name, &wl_seat_interface,
+				version >= 8 ? 8 : 5);
 
 		wl_seat_add_listener(seat->wl_seat, &seat_listener, seat);
 
@@ -1064,27 +2690,36 @@ handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		nag->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
 	} else if (strcmp(interface, wl_output_interface.name) == 0) {
-		if (!nag->output) {
-			struct output *output = calloc(1, sizeof(*output));
-			if (!output) {
-				perror("calloc");
-				return;
-			}
-			output->wl_output = wl_registry_bind(registry, name,
-					&wl_output_interface, 4);
-			output->wl_name = name;
-			output->scale = 1;
-			output->nag = nag;
-			wl_list_insert(&nag->outputs, &output->link);
-			wl_output_add_listener(output->wl_output,
-					&output_listener, output);
+		struct output *output = calloc(1, sizeof(*output));
+		if (!output) {
+			perror("calloc");
+			return;
 		}
+		output->wl_output = wl_registry_bind(registry, name,
+				&wl_output_interface, 4);
+		output->wl_name = name;
+		output->scale = 1;
+		output->nag = nag;
+		wl_list_insert(&nag->outputs, &output->link);
+		wl_output_add_listener(output->wl_output,
+				&output_listener, output);
 	} else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
 		nag->layer_shell = wl_registry_bind(
 				registry, name, &zwlr_layer_shell_v1_interface, 1);
 	} else if (strcmp(interface, wp_cursor_shape_manager_v1_interface.name) == 0) {
 		nag->cursor_shape_manager = wl_registry_bind(
 				registry, name, &wp_cursor_shape_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		nag->viewporter = wl_registry_bind(
+				registry, name, &wp_viewporter_interface, 1);
+	} else if (strcmp(interface,
+			wp_fractional_scale_manager_v1_interface.name) == 0) {
+		nag->fractional_scale_manager = wl_registry_bind(registry, name,
+				&wp_fractional_scale_manager_v1_interface, 1);
+	} else if (strcmp(interface,
+			wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+		nag->single_pixel_manager = wl_registry_bind(registry, name,
+				&wp_single_pixel_buffer_manager_v1_interface, 1);
 	}
 }
 
@@ -1092,8 +2727,15 @@ static void
 handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
 {
 	struct nag *nag = data;
-	if (nag->output->wl_name == name) {
-		nag->run_display = false;
+	struct output *output, *tmpoutput;
+	wl_list_for_each_safe(output, tmpoutput, &nag->outputs, link) {
+		if (output->wl_name == name) {
+			if (nag->output == output) {
+				nag->output = NULL;
+				nag->run_display = false;
+			}
+			output_destroy(output);
+		}
 	}
 
 	struct seat *seat, *tmpseat;
@@ -1112,19 +2754,86 @@ static const struct wl_registry_listener registry_listener = {
 static void
 nag_setup_cursors(struct nag *nag)
 {
-	struct seat *seat;
+	nag->cursor_theme_name = getenv("XCURSOR_THEME");
+	nag->cursor_size = 24;
+	const char *env_cursor_size = getenv("XCURSOR_SIZE");
+	if (env_cursor_size && *env_cursor_size) {
+		errno = 0;
+		char *end;
+		unsigned int size = strtoul(env_cursor_size, &end, 10);
+		if (!*end && errno == 0) {
+			nag->cursor_size = size;
+		}
+	}
+}
 
-	wl_list_for_each(seat, &nag->seats, link) {
-		struct pointer *p = &seat->pointer;
+/* Returns a single pixel buffer of @color, or NULL if not supported */
+static struct wl_buffer *
+create_solid_buffer(struct nag *nag, uint32_t color)
+{
+	if (!nag->single_pixel_manager || !nag->viewporter) {
+		return NULL;
+	}
+	/* Premultiplied, with 32 bits per channel */
+	double alpha = (color & 0xFF) / 255.0;
+	return wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+		nag->single_pixel_manager,
+		(color >> 24 & 0xFF) / 255.0 * alpha * UINT32_MAX,
+		(color >> 16 & 0xFF) / 255.0 * alpha * UINT32_MAX,
+		(color >> 8 & 0xFF) / 255.0 * alpha * UINT32_MAX,
+		alpha * UINT32_MAX);
+}
 
-		p->cursor_surface =
-			wl_compositor_create_surface(nag->compositor);
-		assert(p->cursor_surface);
+static void
+panel_init(struct panel *panel, struct nag *nag, struct wl_surface *surface,
+		struct wl_buffer *solid)
+{
+	panel->surface = surface;
+	if (surface != nag->surface) {
+		panel->subsurface = wl_subcompositor_get_subsurface(
+			nag->subcompositor, surface, nag->surface);
+		/* Pointer input goes to the bar, in its coordinates */
+		struct wl_region *region =
+			wl_compositor_create_region(nag->compositor);
+		wl_surface_set_input_region(surface, region);
+		wl_region_destroy(region);
+	}
+	if (nag->viewporter) {
+		panel->viewport = wp_viewporter_get_viewport(nag->viewporter,
+			surface);
+	}
+	panel->solid = solid;
+	if (!solid) {
+		/* Without transparency the compositor can skip blending */
+		uint32_t format = (nag->conf->background & 0xFF) == 0xFF
+			? WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888;
+		swapchain_init(&panel->swapchain, nag->shm, format,
+			MAX_BUFFERS, buffer_released, nag);
+	}
+}
+
+/* Subsurfaces are stacked in the order they are created */
+static void
+nag_setup_panels(struct nag *nag)
+{
+	struct wl_buffer *background =
+		create_solid_buffer(nag, nag->conf->background);
+	panel_init(&nag->panels[PANEL_BAR], nag, nag->surface, background);
+	for (int i = PANEL_MESSAGE; i <= PANEL_DETAILS; i++) {
+		panel_init(&nag->panels[i], nag,
+			wl_compositor_create_surface(nag->compositor), NULL);
+	}
+	wl_subsurface_set_desync(nag->panels[PANEL_DETAILS].subsurface);
+	if (background) {
+		panel_init(&nag->panels[PANEL_BORDER], nag,
+			wl_compositor_create_surface(nag->compositor),
+			create_solid_buffer(nag, nag->conf->border_bottom));
 	}
 }
 
+/* Everything which is kept between messages with --daemon */
 static void
-nag_setup(struct nag *nag)
+nag_connect(struct nag *nag)
 {
 	nag->display = wl_display_connect(NULL);
 	if (!nag->display) {
@@ -1135,15 +2844,18 @@ nag_setup(struct nag *nag)
 	}
 
 	nag->scale = 1;
+	nag->output_scale = 1;
 
-	struct wl_registry *registry = wl_display_get_registry(nag->display);
-	wl_registry_add_listener(registry, &registry_listener, nag);
+	/* Kept to see outputs and seats come and go */
+	nag->registry = wl_display_get_registry(nag->display);
+	wl_registry_add_listener(nag->registry, &registry_listener, nag);
 	if (wl_display_roundtrip(nag->display) < 0) {
 		wlr_log(WLR_ERROR, "failed to register with the wayland display");
 		exit(LAB_EXIT_FAILURE);
 	}
 
-	assert(nag->compositor && nag->layer_shell && nag->shm);
+	assert(nag->compositor && nag->subcompositor && nag->layer_shell
+		&& nag->shm);
 
 	/* Second roundtrip to get wl_output properties */
 	if (wl_display_roundtrip(nag->display) < 0) {
@@ -1152,77 +2864,518 @@ nag_setup(struct nag *nag)
 		exit(LAB_EXIT_FAILURE);
 	}
 
-	if (!nag->output && nag->conf->output) {
-		wlr_log(WLR_ERROR, "Output '%s' not found", nag->conf->output);
-		nag_destroy(nag);
-		exit(LAB_EXIT_FAILURE);
+	if (!nag->cursor_shape_manager) {
+		nag_setup_cursors(nag);
+	}
+
+	nag->pollfds[FD_WAYLAND].fd = wl_display_get_fd(nag->display);
+	nag->pollfds[FD_WAYLAND].events = POLLIN;
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	nag->pollfds[FD_SIGNAL].fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	nag->pollfds[FD_SIGNAL].events = POLLIN;
+
+	nag->pollfds[FD_SCROLL].fd = timerfd_create(CLOCK_MONOTONIC,
+		TFD_CLOEXEC | TFD_NONBLOCK);
+	nag->pollfds[FD_SCROLL].events = POLLIN;
+}
+
+/* Restart the timeout of the message, or stop it if @seconds is 0 */
+static void
+nag_set_timeout(struct nag *nag, int seconds)
+{
+	close_pollfd(&nag->pollfds[FD_TIMER]);
+	nag->details.close_timeout = seconds;
+	if (seconds <= 0) {
+		return;
+	}
+	nag->pollfds[FD_TIMER].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	nag->pollfds[FD_TIMER].events = POLLIN;
+	struct itimerspec timeout = {
+		.it_value.tv_sec = seconds,
+	};
+	timerfd_settime(nag->pollfds[FD_TIMER].fd, 0, &timeout, NULL);
+}
+
+/* Size the bar to the message, and start its timeout and reading input */
+static void
+nag_start_message(struct nag *nag)
+{
+	uint32_t height = nag_layout(nag);
+	if (height != nag->height) {
+		nag_set_size(nag, height);
+	} else {
+		/* The same bar, the zone is committed with the next frame */
+		zwlr_layer_surface_v1_set_exclusive_zone(nag->layer_surface,
+			nag->details.use_exclusive_zone ? height : 0);
+	}
+
+	nag_set_timeout(nag, nag->details.close_timeout);
+
+	if (nag->details.reading) {
+		nag->details.stdin_flags = set_nonblock(STDIN_FILENO);
+		nag->pollfds[FD_STDIN].fd = STDIN_FILENO;
+		nag->pollfds[FD_STDIN].events = POLLIN;
+	} else {
+		nag->pollfds[FD_STDIN].fd = -1;
+	}
+
+	if (nag->control.fd >= 0) {
+		nag->control.flags = set_nonblock(nag->control.fd);
+		nag->pollfds[FD_CONTROL].fd = nag->control.fd;
+		nag->pollfds[FD_CONTROL].events = POLLIN;
+	} else {
+		nag->pollfds[FD_CONTROL].fd = -1;
+	}
+}
+
+/* Map the bar for the message in nag, returns false if it cannot be shown */
+static bool
+nag_show(struct nag *nag)
+{
+	if (nag->conf->output) {
+		struct output *output;
+		wl_list_for_each(output, &nag->outputs, link) {
+			if (g_strcmp0(output->name, nag->conf->output) == 0) {
+				nag->output = output;
+			}
+		}
+		if (!nag->output) {
+			wlr_log(WLR_ERROR, "Output '%s' not found",
+				nag->conf->output);
+			return false;
+		}
+	}
+
+	nag->surface = wl_compositor_create_surface(nag->compositor);
+	assert(nag->surface);
+	wl_surface_add_listener(nag->surface, &surface_listener, nag);
+
+	/* Draw at the exact scale, and let the viewports map it to the surface */
+	if (nag->viewporter && nag->fractional_scale_manager) {
+		nag->fractional_scale =
+			wp_fractional_scale_manager_v1_get_fractional_scale(
+				nag->fractional_scale_manager, nag->surface);
+		wp_fractional_scale_v1_add_listener(nag->fractional_scale,
+			&fractional_scale_listener, nag);
+	}
+
+	nag->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+			nag->layer_shell, nag->surface,
+			nag->output ? nag->output->wl_output : NULL,
+			nag->conf->layer,
+			"nag");
+	assert(nag->layer_surface);
+	zwlr_layer_surface_v1_add_listener(nag->layer_surface,
+			&layer_surface_listener, nag);
+	zwlr_layer_surface_v1_set_anchor(nag->layer_surface,
+			nag->conf->anchors);
+	nag_setup_panels(nag);
+
+	/*
+	 * Lay out before the initial commit so that the first configure
+	 * already has the final height and can be drawn straight away.
+	 */
+	if (nag->output) {
+		nag_set_output_scale(nag, nag->output->scale);
+	}
+	nag_start_message(nag);
+	return true;
+}
+
+static void
+close_pollfd(struct pollfd *pollfd)
+{
+	if (pollfd->fd == -1) {
+		return;
+	}
+	close(pollfd->fd);
+	pollfd->fd = -1;
+	pollfd->events = 0;
+	pollfd->revents = 0;
+}
+
+/*
+ * Make reads from @fd return at once. Returns the file status flags to give
+ * back with close_nonblock(), as the file may be shared, e.g. a pipe or the
+ * terminal of the shell.
+ */
+static int
+set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags != -1) {
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	}
+	return flags;
+}
+
+static void
+close_nonblock(struct pollfd *pollfd, int flags)
+{
+	if (pollfd->fd != -1 && flags != -1) {
+		fcntl(pollfd->fd, F_SETFL, flags);
+	}
+	close_pollfd(pollfd);
+}
+
+/*
+ * Show what has been read so far. When following with a tail to keep, the
+ * oldest lines are dropped in batches so that the cost of moving the text is
+ * amortised.
+ */
+static void
+details_text_update(struct nag *nag, const char *text, size_t len)
+{
+	struct details_model *model = &nag->details.model;
+	details_model_update(model, text, len);
+
+	size_t tail = nag->details.tail_lines;
+	size_t max_bytes = nag->details.max_bytes;
+	if (tail && nag->details.follow && nag->details.reading) {
+		size_t drop = 0;
+		if (model->nr_paragraphs > tail + tail / 4) {
+			drop = model->nr_paragraphs - tail;
+		}
+		if (max_bytes && len > max_bytes) {
+			while (drop < model->nr_paragraphs - 1 && len
+					- model->paragraphs[drop].start > max_bytes / 4 * 3) {
+				++drop;
+			}
+		}
+		size_t bytes = model->paragraphs[drop].start;
+
+		/*
+		 * A line which does not end, e.g. a spinner using \r, is all
+		 * that is left then. It keeps its last bytes.
+		 */
+		bool cut = max_bytes && len - bytes > max_bytes;
+		if (cut) {
+			bytes = len - max_bytes / 4 * 3;
+			while (bytes < len
+					&& ((unsigned char)text[bytes] & 0xC0) == 0x80) {
+				++bytes;
+			}
+		}
+		if (bytes) {
+			details_reader_drop_front(&nag->details.reader, bytes);
+			text = nag->details.reader.buffer;
+			len -= bytes;
+			details_model_drop_bytes(model, bytes, text, len);
+
+			struct details_pos *pos = &nag->details.pos;
+			if (pos->paragraph > drop
+					|| (pos->paragraph == drop && !cut)) {
+				pos->paragraph -= drop;
+			} else {
+				*pos = (struct details_pos){ 0, 0 };
+			}
+		}
+	}
+
+	nag->details.text = text;
+	nag->details.text_len = len;
+	if (nag->details.visible) {
+		schedule_frame(nag);
+	}
+}
+
+/* Set up the details model and the button to toggle them, once there are any */
+static void
+details_add_button(struct nag *nag)
+{
+	nag->details.button_up.text = "▲";
+	nag->details.button_down.text = "▼";
+	details_model_init(&nag->details.model, nag->details.text,
+		nag->details.text_len);
+	nag->details.button_details = calloc(1, sizeof(struct button));
+	assert(nag->details.button_details);
+	nag->details.button_details->text = nag->details.details_text;
+	assert(nag->details.button_details->text);
+	if (nag->details.reading && !nag->details.follow) {
+		nag->details.loading_text = g_strdup_printf("%s (loading…)",
+			nag->details.details_text);
+		nag->details.button_details->text = nag->details.loading_text;
+	}
+	nag->details.button_details->expand = true;
+	wl_list_insert(nag->buttons.prev, &nag->details.button_details->link);
+}
+
+/*
+ * Append @line to the details, which are followed from then on as with
+ * --follow and to the same limits.
+ */
+static void
+details_append(struct nag *nag, const char *line)
+{
+	if (nag->pollfds[FD_STDIN].fd >= 0) {
+		/* Not mixed into the lines of stdin, but added after them */
+		size_t len = strlen(line) + 1;
+		size_t max_bytes = nag->details.max_bytes;
+		if (max_bytes && nag->control.details_len + len > max_bytes) {
+			wlr_log(WLR_ERROR, "Too many details, ignoring them");
+			return;
+		}
+		char *details = realloc(nag->control.details,
+			nag->control.details_len + len);
+		if (!details) {
+			perror("realloc");
+			return;
+		}
+		memcpy(details + nag->control.details_len, line, len);
+		nag->control.details = details;
+		nag->control.details_len += len;
+		return;
+	}
+
+	struct details_reader *reader = &nag->details.reader;
+	if (!nag->details.reading) {
+		bool tail = nag->details.tail_lines;
+		details_reader_init(reader, tail ? 0 : nag->details.max_bytes,
+			tail ? 0 : nag->details.max_lines, 0);
+		if (nag->details.text_len) {
+			details_reader_feed(reader, nag->details.text,
+				nag->details.text_len);
+			details_reader_feed(reader, "\n", 1);
+		}
+		nag->details.reading = true;
+		nag->details.follow = true;
+		nag->details.follow_bottom = true;
+	}
+	if (!nag->details.button_details) {
+		nag->details.text = "";
+		nag->details.text_len = 0;
+		details_add_button(nag);
+		schedule_frame(nag);
+	}
+
+	details_reader_feed(reader, line, strlen(line));
+	details_reader_feed(reader, "\n", 1);
+	const char *text = reader->buffer ? reader->buffer : "";
+	details_text_update(nag, text,
+		details_trim(text, reader->len, reader->len, 0));
+}
+
+/* Read what stdin has to offer without starving the rest of the loop */
+#define STDIN_MAX_READS 16
+static void
+handle_stdin(struct nag *nag)
+{
+	struct details_reader *reader = &nag->details.reader;
+	ssize_t nread = 0;
+	for (int i = 0; i < STDIN_MAX_READS; i++) {
+		nread = details_reader_read(reader, nag->pollfds[FD_STDIN].fd);
+		if (nread <= 0) {
+			break;
+		}
+	}
+
+	if (nread < 0 && errno == EAGAIN) {
+		nread = 1;
+	} else if (nread < 0) {
+		wlr_log_errno(WLR_ERROR, "Failed to read stdin");
+	}
+	if (!nag->details.follow) {
+		/* Nothing is shown before EOF or the input limit */
+		if (nread > 0 && !details_reader_done(reader)) {
+			return;
+		}
+		nread = 0;
+	}
+
+	if (nread > 0) {
+		/* Hide a trailing newline or partial UTF-8 until completed */
+		const char *text = reader->buffer ? reader->buffer : "";
+		details_text_update(nag, text,
+			details_trim(text, reader->len, reader->len, 0));
+		return;
 	}
 
-	if (!nag->cursor_shape_manager) {
-		nag_setup_cursors(nag);
+	close_nonblock(&nag->pollfds[FD_STDIN], nag->details.stdin_flags);
+	nag->details.reading = false;
+	size_t len;
+	free(nag->details.message);
+	nag->details.message = details_reader_finish(reader, &len);
+	details_text_update(nag, nag->details.message,
+		details_trim(nag->details.message, len, len, 0));
+
+	if (nag->details.button_details->text != nag->details.details_text) {
+		nag->details.button_details->text = nag->details.details_text;
+		schedule_frame(nag);
 	}
 
-	nag->surface = wl_compositor_create_surface(nag->compositor);
-	assert(nag->surface);
-	wl_surface_add_listener(nag->surface, &surface_listener, nag);
+	/* The details added by commands while stdin was read */
+	char *held = nag->control.details;
+	size_t held_len = nag->control.details_len;
+	nag->control.details = NULL;
+	nag->control.details_len = 0;
+	for (size_t i = 0; i < held_len; i += strlen(held + i) + 1) {
+		details_append(nag, held + i);
+	}
+	free(held);
+}
 
-	nag->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-			nag->layer_shell, nag->surface,
-			nag->output ? nag->output->wl_output : NULL,
-			nag->conf->layer,
-			"nag");
-	assert(nag->layer_surface);
-	zwlr_layer_surface_v1_add_listener(nag->layer_surface,
-			&layer_surface_listener, nag);
-	zwlr_layer_surface_v1_set_anchor(nag->layer_surface,
-			nag->conf->anchors);
+/* Add a button from "<text>[\t<action>]", first like those of -B */
+static void
+control_add_button(struct nag *nag, const char *arg, bool dismiss)
+{
+	/* The strings are kept after the button, to be freed along with it */
+	size_t len = strlen(arg) + 1;
+	struct button *button = calloc(1, sizeof(*button) + len);
+	if (!button) {
+		perror("calloc");
+		return;
+	}
+	button->text = (char *)(button + 1);
+	memcpy(button->text, arg, len);
+	char *tab = strchr(button->text, '\t');
+	if (tab) {
+		*tab = '\0';
+		button->action = tab + 1;
+	}
+	button->dismiss = dismiss;
+	wl_list_insert(&nag->buttons, &button->link);
+	schedule_frame(nag);
+}
 
-	wl_registry_destroy(registry);
+/* Set the progress from a percentage, returns false if it is not one */
+static bool
+nag_set_progress(struct nag *nag, const char *value)
+{
+	char *end;
+	double percent = strtod(value, &end);
+	if (end == value || (*end && strcmp(end, "%") != 0)) {
+		return false;
+	}
+	if (!(percent >= 0)) {
+		percent = 0;
+	} else if (percent > 100) {
+		percent = 100;
+	}
+	nag->progress.enabled = true;
+	if (percent != nag->progress.percent) {
+		nag->progress.percent = percent;
+		schedule_frame(nag);
+	}
+	return true;
+}
 
-	nag->pollfds[FD_WAYLAND].fd = wl_display_get_fd(nag->display);
-	nag->pollfds[FD_WAYLAND].events = POLLIN;
+/*
+ * Run a line of --control-fd. Commands only change what they are about, and
+ * the next frame lays out and damages just what that moved.
+ */
+static void
+control_command(struct nag *nag, char *line)
+{
+	/* With --progress, a bare number is the progress */
+	if (nag->progress.enabled && nag_set_progress(nag, line)) {
+		return;
+	}
 
-	if (nag->details.close_timeout != 0) {
-		nag->pollfds[FD_TIMER].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-		nag->pollfds[FD_TIMER].events = POLLIN;
-		struct itimerspec timeout = {
-			.it_value.tv_sec = nag->details.close_timeout,
-		};
-		timerfd_settime(nag->pollfds[FD_TIMER].fd, 0, &timeout, NULL);
+	char *arg = strchr(line, ' ');
+	if (arg) {
+		*arg++ = '\0';
 	} else {
-		nag->pollfds[FD_TIMER].fd = -1;
+		arg = line + strlen(line);
 	}
 
-	sigset_t mask;
-	sigaddset(&mask, SIGINT);
-	sigaddset(&mask, SIGTERM);
-	sigprocmask(SIG_BLOCK, &mask, NULL);
-	nag->pollfds[FD_SIGNAL].fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
-	nag->pollfds[FD_SIGNAL].events = POLLIN;
+	if (strcmp(line, "message") == 0) {
+		char *message = strdup(arg);
+		if (!message) {
+			perror("strdup");
+			return;
+		}
+		free(nag->control.message);
+		nag->control.message = message;
+		nag->message = message;
+		schedule_frame(nag);
+	} else if (strcmp(line, "details") == 0) {
+		details_append(nag, arg);
+	} else if (strcmp(line, "button") == 0) {
+		control_add_button(nag, arg, false);
+	} else if (strcmp(line, "button-dismiss") == 0) {
+		control_add_button(nag, arg, true);
+	} else if (strcmp(line, "clear-buttons") == 0) {
+		struct button *button, *next;
+		wl_list_for_each_safe(button, next, &nag->buttons, link) {
+			if (button != nag->details.button_details) {
+				wl_list_remove(&button->link);
+				free(button);
+			}
+		}
+		schedule_frame(nag);
+	} else if (strcmp(line, "progress") == 0) {
+		if (!nag_set_progress(nag, arg)) {
+			wlr_log(WLR_ERROR, "Invalid progress '%s'", arg);
+		}
+	} else if (strcmp(line, "timeout") == 0) {
+		nag_set_timeout(nag, atoi(arg));
+	} else if (strcmp(line, "dismiss") == 0) {
+		nag->run_display = false;
+	} else if (*line) {
+		wlr_log(WLR_ERROR, "Unknown control command '%s'", line);
+	}
 }
 
+/* Run the complete lines of --control-fd, all before the next frame */
 static void
-close_pollfd(struct pollfd *pollfd)
+handle_control(struct nag *nag)
 {
-	if (pollfd->fd == -1) {
-		return;
+	ssize_t nread = 0;
+	for (int i = 0; i < STDIN_MAX_READS; i++) {
+		char *buffer = nag->control.buffer;
+		nread = read(nag->pollfds[FD_CONTROL].fd,
+			buffer + nag->control.len,
+			sizeof(nag->control.buffer) - nag->control.len);
+		if (nread <= 0) {
+			break;
+		}
+		char *start = buffer;
+		char *end = buffer + nag->control.len + nread;
+		char *newline;
+		while ((newline = memchr(start, '\n', end - start))) {
+			*newline = '\0';
+			if (!nag->control.skip_line) {
+				control_command(nag, start);
+			}
+			nag->control.skip_line = false;
+			start = newline + 1;
+		}
+		nag->control.len = end - start;
+		memmove(buffer, start, nag->control.len);
+		if (nag->control.len == sizeof(nag->control.buffer)) {
+			wlr_log(WLR_ERROR, "Control line too long, ignoring it");
+			nag->control.skip_line = true;
+			nag->control.len = 0;
+		}
+	}
+
+	if (nread == 0 || (nread < 0 && errno != EAGAIN && errno != EINTR)) {
+		/* The bar stays up, as if shown without --control-fd */
+		close_nonblock(&nag->pollfds[FD_CONTROL], nag->control.flags);
 	}
-	close(pollfd->fd);
-	pollfd->fd = -1;
-	pollfd->events = 0;
-	pollfd->revents = 0;
 }
 
 static void
 nag_run(struct nag *nag)
 {
 	nag->run_display = true;
-	render_frame(nag);
+	schedule_frame(nag);
 	while (nag->run_display) {
 		while (wl_display_prepare_read(nag->display) != 0) {
 			wl_display_dispatch_pending(nag->display);
 		}
 
+		if (nag->dirty && !nag->frame_callback
+				&& !nag->configure_pending
+				&& !nag->waiting_for_buffer) {
+			render_frame(nag);
+		}
+
 		errno = 0;
 		if (wl_display_flush(nag->display) == -1 && errno != EAGAIN) {
 			break;
@@ -1232,7 +3385,7 @@ nag_run(struct nag *nag)
 			break;
 		}
 
-		poll(nag->pollfds, NR_FDS, -1);
+		poll(nag->pollfds, NR_FDS, run_timeout(nag));
 		if (nag->pollfds[FD_WAYLAND].revents & POLLIN) {
 			wl_display_read_events(nag->display);
 		} else {
@@ -1242,8 +3395,32 @@ nag_run(struct nag *nag)
 			break;
 		}
 		if (nag->pollfds[FD_SIGNAL].revents & POLLIN) {
+			nag->quit = true;
 			break;
 		}
+		if (nag->pollfds[FD_CLIENT].revents & (POLLHUP | POLLERR)) {
+			/* Clients going away would have taken the bar along */
+			struct queued *front =
+				wl_container_of(nag->queue.next, front, link);
+			if (!queued_prune(front)) {
+				break;
+			}
+			nag->pollfds[FD_CLIENT].fd = front->clients[0];
+		}
+		/* Not into a dismissed message, which could not be replaced */
+		if (nag->run_display) {
+			handle_requests(nag);
+			prune_stacked(nag);
+		}
+		if (nag->pollfds[FD_STDIN].revents & (POLLIN | POLLHUP | POLLERR)) {
+			handle_stdin(nag);
+		}
+		if (nag->pollfds[FD_CONTROL].revents & (POLLIN | POLLHUP | POLLERR)) {
+			handle_control(nag);
+		}
+		if (nag->pollfds[FD_SCROLL].revents & POLLIN) {
+			handle_kinetic_scroll(nag);
+		}
 	}
 }
 
@@ -1279,6 +3456,27 @@ conf_init(struct conf *conf)
 	conf->border_bottom = 0x470909FF;
 }
 
+/* Set what the options of a message default to */
+static void
+nag_init_message(struct nag *nag, struct conf *conf)
+{
+	*conf = (struct conf){ 0 };
+	conf_init(conf);
+	nag->conf = conf;
+	nag->message = NULL;
+	nag->tag = NULL;
+	nag->control.fd = -1;
+	nag->progress.enabled = false;
+	nag->progress.percent = 0;
+	wl_list_init(&nag->buttons);
+
+	memset(&nag->details, 0, sizeof(nag->details));
+	nag->details.details_text = "Toggle details";
+	nag->details.close_timeout = 5;
+	nag->details.use_exclusive_zone = false;
+	nag->details.max_bytes = DETAILS_MAX_BYTES;
+}
+
 static bool
 parse_color(const char *color, uint32_t *result)
 {
@@ -1298,47 +3496,89 @@ parse_color(const char *color, uint32_t *result)
 	return true;
 }
 
-/*
- * As labnag is slow for large "detailed messages" we curtail stdin at an
- * arbitrary size to avoid hogging the CPU.
- */
-#define MAX_STDIN_LINES 200
 static char *
-read_and_trim_stdin(void)
-{
-	char *buffer = NULL, *line = NULL;
-	size_t buffer_len = 0, line_size = 0;
-	int line_count = 0;
-	while (line_count < MAX_STDIN_LINES) {
-		ssize_t nread = getline(&line, &line_size, stdin);
-		if (nread == -1) {
-			if (feof(stdin)) {
-				break;
-			} else {
-				perror("getline");
-				goto freeline;
-			}
-		}
-		buffer = realloc(buffer, buffer_len + nread + 1);
-		if (!buffer) {
-			perror("realloc");
+read_details_fd(struct nag *nag, int fd, size_t *len)
+{
+	struct details_reader reader;
+	details_reader_init(&reader, nag->details.max_bytes,
+		nag->details.max_lines, nag->details.tail_lines);
+	while (!details_reader_done(&reader)) {
+		ssize_t nread = details_reader_read(&reader, fd);
+		if (nread < 0) {
+			perror("read");
+			free(details_reader_finish(&reader, len));
 			return NULL;
+		} else if (nread == 0) {
+			break;
 		}
-		memcpy(&buffer[buffer_len], line, nread + 1);
-		buffer_len += nread;
-		++line_count;
 	}
-	free(line);
+	return details_reader_finish(&reader, len);
+}
+
+/*
+ * Whether the file is unlikely to be truncated while mapped, which would
+ * raise SIGBUS on the next repaint: it is on a read-only file system or
+ * nobody may write to it.
+ */
+static bool
+file_is_fixed(int fd, const struct stat *st)
+{
+	struct statvfs vfs;
+	if (fstatvfs(fd, &vfs) == 0 && (vfs.f_flag & ST_RDONLY)) {
+		return true;
+	}
+	return !(st->st_mode & (S_IWUSR | S_IWGRP | S_IWOTH));
+}
+
+/*
+ * Regular files which cannot change are mapped read-only and handed to the
+ * details model as is, anything else (pipes, character devices, logs still
+ * written to) is read like stdin. With a tail to retain, the mapping is
+ * streamed through the reader instead.
+ */
+static bool
+load_details_file(struct nag *nag, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return false;
+	}
 
-	while (buffer_len && buffer[buffer_len - 1] == '\n') {
-		buffer[--buffer_len] = '\0';
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+			|| !file_is_fixed(fd, &st)) {
+		nag->details.message = read_details_fd(nag, fd,
+			&nag->details.text_len);
+		nag->details.text = nag->details.message;
+		close(fd);
+		return nag->details.message != NULL;
 	}
 
-	return buffer;
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	if (nag->details.tail_lines) {
+		struct details_reader reader;
+		details_reader_init(&reader, nag->details.max_bytes,
+			nag->details.max_lines, nag->details.tail_lines);
+		details_reader_feed(&reader, data, st.st_size);
+		munmap(data, st.st_size);
+		nag->details.message = details_reader_finish(&reader,
+			&nag->details.text_len);
+		nag->details.text = nag->details.message;
+		return true;
+	}
 
-freeline:
-	free(line);
-	return NULL;
+	nag->details.mapping = data;
+	nag->details.mapping_size = st.st_size;
+	nag->details.text = data;
+	nag->details.text_len = details_trim(data, st.st_size,
+		nag->details.max_bytes, nag->details.max_lines);
+	return true;
 }
 
 static int
@@ -1361,6 +3601,16 @@ nag_parse_options(int argc, char **argv, struct nag *nag,
 		TO_GAP_BTN_DISMISS,
 		TO_MARGIN_BTN_RIGHT,
 		TO_PADDING_BTN,
+		TO_DETAILS_FILE,
+		TO_DETAILS_MAX_BYTES,
+		TO_DETAILS_MAX_LINES,
+		TO_DETAILS_TAIL,
+		TO_FOLLOW,
+		TO_DAEMON,
+		TO_STACK,
+		TO_REPLACE,
+		TO_CONTROL_FD,
+		TO_PROGRESS,
 	};
 
 	static const struct option opts[] = {
@@ -1393,6 +3643,16 @@ nag_parse_options(int argc, char **argv, struct nag *nag,
 		{"button-dismiss-gap", required_argument, NULL, TO_GAP_BTN_DISMISS},
 		{"button-margin-right", required_argument, NULL, TO_MARGIN_BTN_RIGHT},
 		{"button-padding", required_argument, NULL, TO_PADDING_BTN},
+		{"details-file", required_argument, NULL, TO_DETAILS_FILE},
+		{"details-max-bytes", required_argument, NULL, TO_DETAILS_MAX_BYTES},
+		{"details-max-lines", required_argument, NULL, TO_DETAILS_MAX_LINES},
+		{"details-tail", required_argument, NULL, TO_DETAILS_TAIL},
+		{"follow", no_argument, NULL, TO_FOLLOW},
+		{"daemon", no_argument, NULL, TO_DAEMON},
+		{"stack", required_argument, NULL, TO_STACK},
+		{"replace", required_argument, NULL, TO_REPLACE},
+		{"control-fd", required_argument, NULL, TO_CONTROL_FD},
+		{"progress", no_argument, NULL, TO_PROGRESS},
 
 		{0, 0, 0, 0}
 	};
@@ -1411,6 +3671,16 @@ nag_parse_options(int argc, char **argv, struct nag *nag,
 		"  -h, --help                      Show help message and quit.\n"
 		"  -l, --detailed-message          Read a detailed message from stdin.\n"
 		"  -L, --detailed-button <text>    Set the text of the detail button.\n"
+		"  --details-file <path>           Read a detailed message from a file.\n"
+		"  --details-max-bytes <bytes>     Limit the detailed message size.\n"
+		"  --details-max-lines <lines>     Limit the detailed message lines.\n"
+		"  --details-tail <lines>          Also keep the last lines of details.\n"
+		"  --follow                        Keep appending stdin to details.\n"
+		"  --daemon                        Show the messages of later calls.\n"
+		"  --stack <n>                     Show up to n of them at once.\n"
+		"  --replace <tag>                 Replace the message with this tag.\n"
+		"  --control-fd <fd>               Read commands to update the bar.\n"
+		"  --progress                      Show a progress bar.\n"
 		"  -m, --message <msg>             Set the message text.\n"
 		"  -o, --output <output>           Set the output to use.\n"
 		"  -t, --timeout <seconds>         Set duration to close dialog.\n"
@@ -1434,7 +3704,8 @@ nag_parse_options(int argc, char **argv, struct nag *nag,
 		"  --button-margin-right margin    Margin from dismiss button to edge.\n"
 		"  --button-padding padding        Padding for the button text.\n";
 
-	optind = 1;
+	/* Reset completely, as --daemon parses the options of each request */
+	optind = 0;
 	while (1) {
 		int c = getopt_long(argc, argv, "B:Z:c:de:y:f:hlL:m:o:s:t:vx", opts, NULL);
 		if (c == -1) {
@@ -1495,13 +3766,7 @@ nag_parse_options(int argc, char **argv, struct nag *nag,
 			conf->font_description = pango_font_description_from_string(optarg);
 			break;
 		case 'l': /* Detailed Message */
-			free(nag->details.message);
-			nag->details.message = read_and_trim_stdin();
-			if (!nag->details.message) {
-				return LAB_EXIT_FAILURE;
-			}
-			nag->details.button_up.text = "▲";
-			nag->details.button_down.text = "▼";
+			nag->details.read_stdin = true;
 			break;
 		case 'L': /* Detailed Button Text */
 			nag->details.details_text = optarg;
@@ -1510,7 +3775,6 @@ nag_parse_options(int argc, char **argv, struct nag *nag,
 			nag->message = optarg;
 			break;
 		case 'o': /* Output */
-			free(conf->output);
 			conf->output = optarg;
 			break;
 		case 't':
@@ -1581,32 +3845,317 @@ nag_parse_options(int argc, char **argv, struct nag *nag,
 		case TO_PADDING_BTN: /* Padding for the button text */
 			conf->button_padding = strtol(optarg, NULL, 0);
 			break;
+		case TO_DETAILS_FILE: /* Detailed message file */
+			nag->details.path = optarg;
+			break;
+		case TO_DETAILS_MAX_BYTES: /* Detailed message size limit */
+			nag->details.max_bytes = strtoull(optarg, NULL, 0);
+			break;
+		case TO_DETAILS_MAX_LINES: /* Detailed message line limit */
+			nag->details.max_lines = strtoull(optarg, NULL, 0);
+			break;
+		case TO_DETAILS_TAIL: /* Detailed message lines kept from the end */
+			nag->details.tail_lines = strtoull(optarg, NULL, 0);
+			break;
+		case TO_FOLLOW: /* Read details from stdin as they arrive */
+			nag->details.follow = true;
+			break;
+		case TO_DAEMON:
+			nag->daemon = true;
+			break;
+		case TO_STACK: /* Messages shown at once with --daemon */
+			nag->stack = strtol(optarg, NULL, 0);
+			if (nag->stack < 1) {
+				nag->stack = 1;
+			}
+			break;
+		case TO_REPLACE: /* Message replaced by later calls */
+			if (!*optarg || strchr(optarg, '/')) {
+				fprintf(stderr, "Invalid tag: %s\n", optarg);
+				return LAB_EXIT_FAILURE;
+			}
+			nag->tag = optarg;
+			break;
+		case TO_PROGRESS: /* Updated from stdin or --control-fd */
+			nag->progress.enabled = true;
+			break;
+		case TO_CONTROL_FD: /* Commands updating the message */
+			nag->control.fd = strtol(optarg, NULL, 0);
+			if (nag->control.fd < 0) {
+				fprintf(stderr, "Invalid control fd: %s\n", optarg);
+				return LAB_EXIT_FAILURE;
+			}
+			break;
 		default: /* Help or unknown flag */
 			fprintf(c == 'h' ? stdout : stderr, "%s", usage);
 			return LAB_EXIT_FAILURE;
 		}
 	}
 
+	/* Details come from one place only */
+	if (nag->details.path && (nag->details.read_stdin
+			|| nag->details.follow)) {
+		fprintf(stderr, "--details-file cannot be used with %s\n",
+			nag->details.follow ? "--follow" : "-l");
+		return LAB_EXIT_FAILURE;
+	}
+
 	return LAB_EXIT_SUCCESS;
 }
 
+/* Read the details once all limits are known, and add their button */
+static bool
+nag_load_details(struct nag *nag)
+{
+	if (nag->details.path) {
+		if (!load_details_file(nag, nag->details.path)) {
+			return false;
+		}
+	} else if (nag->details.follow) {
+		/* The tail is kept by dropping lines as they scroll out */
+		bool tail = nag->details.tail_lines;
+		details_reader_init(&nag->details.reader,
+			tail ? 0 : nag->details.max_bytes,
+			tail ? 0 : nag->details.max_lines, 0);
+		nag->details.reading = true;
+		nag->details.follow_bottom = true;
+		nag->details.text = "";
+	} else if (nag->details.read_stdin) {
+		/* Read from the event loop so that the bar shows up right away */
+		details_reader_init(&nag->details.reader, nag->details.max_bytes,
+			nag->details.max_lines, nag->details.tail_lines);
+		nag->details.reading = true;
+		nag->details.text = "";
+	}
+
+	if (nag->details.text) {
+		details_add_button(nag);
+	}
+	return true;
+}
+
+/* Dispatch events until a request is queued, false on a signal or error */
+static bool
+nag_wait_queue(struct nag *nag)
+{
+	while (wl_list_empty(&nag->queue)) {
+		while (wl_display_prepare_read(nag->display) != 0) {
+			wl_display_dispatch_pending(nag->display);
+		}
+		errno = 0;
+		if (wl_display_flush(nag->display) == -1 && errno != EAGAIN) {
+			wl_display_cancel_read(nag->display);
+			return false;
+		}
+
+		poll(nag->pollfds, NR_FDS, requests_timeout(nag));
+		if (nag->pollfds[FD_WAYLAND].revents & POLLIN) {
+			if (wl_display_read_events(nag->display) < 0) {
+				return false;
+			}
+		} else {
+			wl_display_cancel_read(nag->display);
+		}
+		if (nag->pollfds[FD_SIGNAL].revents & POLLIN) {
+			nag->quit = true;
+			return false;
+		}
+		handle_requests(nag);
+	}
+	return true;
+}
+
+static void
+replace_stdin(int fd)
+{
+	if (fd >= 0 && fd != STDIN_FILENO) {
+		dup2(fd, STDIN_FILENO);
+		close(fd);
+	}
+}
+
+/* Whether the bar shown with @a looks the same with @b, apart from content */
+static bool
+conf_same_bar(const struct conf *a, const struct conf *b)
+{
+	return g_strcmp0(a->output, b->output) == 0
+		&& a->anchors == b->anchors
+		&& a->layer == b->layer
+		&& a->background == b->background
+		&& a->border_bottom == b->border_bottom;
+}
+
+/*
+ * Parse the message of @request into nag, from the working directory and
+ * with the stdin it came with. The strings point into @request.
+ */
+static bool
+nag_parse_request(struct nag *nag, struct ipc_request *request)
+{
+	nag_init_message(nag, nag->conf);
+	if (*request->cwd && chdir(request->cwd) < 0) {
+		wlr_log_errno(WLR_ERROR, "Unable to change to %s", request->cwd);
+	}
+	/* For --detailed-message and --follow */
+	replace_stdin(request->stdin_fd);
+	request->stdin_fd = -1;
+
+	/* Only the options of the daemon itself apply to the daemon */
+	int stack = nag->stack;
+	bool daemon = nag->daemon;
+	bool debug;
+	exit_status = nag_parse_options(request->argc, request->argv, nag,
+		nag->conf, &debug);
+	nag->stack = stack;
+	nag->daemon = daemon;
+	if (nag->control.fd >= 0) {
+		wlr_log(WLR_ERROR, "--control-fd is ignored for messages "
+			"shown by another labnag");
+		nag->control.fd = -1;
+	}
+	if (nag->progress.enabled) {
+		wlr_log(WLR_ERROR, "--progress is ignored for messages "
+			"shown by another labnag");
+		nag->progress.enabled = false;
+	}
+	return exit_status != LAB_EXIT_FAILURE && nag->message
+		&& nag_load_details(nag);
+}
+
+/*
+ * Replace the message shown with the one of @request, which has to outlive
+ * it. The bar is kept if it looks the same, so that only what changed is
+ * drawn again. Returns false if the message is invalid, which dismisses it.
+ */
+static bool
+nag_replace_message(struct nag *nag, struct ipc_request *request)
+{
+	struct conf shown = *nag->conf;
+	nag_clear_message(nag);
+	if (!nag_parse_request(nag, request)) {
+		nag->run_display = false;
+		return false;
+	}
+
+	if (nag->closed || !conf_same_bar(&shown, nag->conf)) {
+		nag_hide(nag);
+		if (!nag_show(nag)) {
+			nag->run_display = false;
+			return false;
+		}
+	} else {
+		nag_start_message(nag);
+	}
+	schedule_frame(nag);
+	return true;
+}
+
+/*
+ * Show the first message in the queue, in the bar of the previous one if it
+ * looks the same, and set the status its clients get.
+ */
+static void
+nag_show_queued(struct nag *nag, struct queued *front, struct conf *shown)
+{
+	/* It is parsed again, along with the details */
+	free_buttons(&front->buttons);
+	front->message = NULL;
+	front->stacked = false;
+
+	if (!nag_parse_request(nag, &front->request)) {
+		front->status = LAB_EXIT_FAILURE;
+		goto done;
+	}
+
+	if (nag->closed || (nag->surface && !conf_same_bar(shown, nag->conf))) {
+		nag_hide(nag);
+	}
+	if (nag->surface) {
+		nag_start_message(nag);
+	} else if (!nag_show(nag)) {
+		front->status = LAB_EXIT_FAILURE;
+		goto done;
+	}
+
+	nag->pollfds[FD_CLIENT].fd = front->clients[0];
+	nag_run(nag);
+	nag->pollfds[FD_CLIENT].fd = -1;
+	front->status = exit_status;
+
+	/* As last shown, which --replace may have changed */
+	g_free(shown->output);
+	*shown = *nag->conf;
+	shown->output = g_strdup(nag->conf->output);
+	shown->font_description = NULL;
+
+done:
+	nag_clear_message(nag);
+	replace_stdin(open("/dev/null", O_RDONLY));
+}
+
+/*
+ * Show the messages of other invocations, up to nag.stack of them at once
+ * and the others queued. The connection to the compositor, the font map,
+ * the caches and the bar itself are kept in between.
+ */
+static int
+nag_serve(struct nag *nag)
+{
+	nag_connect(nag);
+	int listen_fd = ipc_listen(NULL);
+	if (listen_fd < 0) {
+		wlr_log(WLR_ERROR, "labnag is already running as a daemon");
+		return LAB_EXIT_FAILURE;
+	}
+	nag->pollfds[FD_LISTEN].fd = listen_fd;
+	nag->pollfds[FD_LISTEN].events = POLLIN;
+	nag_close(nag);
+	replace_stdin(open("/dev/null", O_RDONLY));
+
+	struct conf shown = { 0 };
+	while (!nag->quit) {
+		if (wl_list_empty(&nag->queue)) {
+			nag_hide(nag);
+			if (!nag_wait_queue(nag)) {
+				break;
+			}
+		}
+		struct queued *front =
+			wl_container_of(nag->queue.next, front, link);
+		if (queued_prune(front)) {
+			nag_show_queued(nag, front, &shown);
+		}
+		queued_finish(front);
+	}
+	g_free(shown.output);
+
+	struct queued *entry, *tmp;
+	wl_list_for_each_safe(entry, tmp, &nag->queue, link) {
+		entry->status = LAB_EXIT_FAILURE;
+		queued_finish(entry);
+	}
+	nag->pollfds[FD_LISTEN].fd = -1;
+	ipc_close(listen_fd, NULL);
+	return nag->quit ? LAB_EXIT_SUCCESS : LAB_EXIT_FAILURE;
+}
+
 int
 main(int argc, char **argv)
 {
-	struct conf conf = { 0 };
-	conf_init(&conf);
-
-	struct nag nag = {
-		.conf = &conf,
-	};
+	struct conf conf;
+	struct nag nag = { 0 };
+	nag_init_message(&nag, &conf);
 
-	wl_list_init(&nag.buttons);
 	wl_list_init(&nag.outputs);
 	wl_list_init(&nag.seats);
-
-	nag.details.details_text = "Toggle details";
-	nag.details.close_timeout = 5;
-	nag.details.use_exclusive_zone = false;
+	wl_list_init(&nag.layout_cache);
+	wl_list_init(&nag.cursor_themes);
+	wl_list_init(&nag.queue);
+	nag.stack = DAEMON_STACK;
+	nag.handoff = (struct ipc_request){ .stdin_fd = -1 };
+	for (size_t i = 0; i < NR_FDS; i++) {
+		nag.pollfds[i].fd = -1;
+	}
 
 	bool debug = false;
 	if (argc > 1) {
@@ -1617,19 +4166,69 @@ main(int argc, char **argv)
 	}
 	wlr_log_init(debug ? WLR_DEBUG : WLR_ERROR, NULL);
 
+	if (nag.daemon) {
+		exit_status = nag_serve(&nag);
+		goto cleanup;
+	}
+
 	if (!nag.message) {
 		wlr_log(WLR_ERROR, "No message passed. Please provide --message/-m");
 		exit_status = LAB_EXIT_FAILURE;
 		goto cleanup;
 	}
 
-	if (nag.details.message) {
-		nag.details.button_details = calloc(1, sizeof(struct button));
-		assert(nag.details.button_details);
-		nag.details.button_details->text = nag.details.details_text;
-		assert(nag.details.button_details->text);
-		nag.details.button_details->expand = true;
-		wl_list_insert(nag.buttons.prev, &nag.details.button_details->link);
+	if (nag.control.fd >= 0 && fcntl(nag.control.fd, F_GETFD) == -1) {
+		wlr_log(WLR_ERROR, "Control fd %d is not open", nag.control.fd);
+		exit_status = LAB_EXIT_FAILURE;
+		goto cleanup;
+	}
+	if (nag.control.fd == STDIN_FILENO
+			&& (nag.details.read_stdin || nag.details.follow)) {
+		wlr_log(WLR_ERROR, "stdin is read for details already");
+		exit_status = LAB_EXIT_FAILURE;
+		goto cleanup;
+	}
+	/* The progress comes from stdin, unless it is used otherwise */
+	if (nag.progress.enabled && nag.control.fd < 0
+			&& !nag.details.read_stdin && !nag.details.follow
+			&& fcntl(STDIN_FILENO, F_GETFD) != -1
+			&& !isatty(STDIN_FILENO)) {
+		nag.control.fd = STDIN_FILENO;
+	}
+	if (nag.progress.enabled && nag.control.fd < 0) {
+		wlr_log(WLR_ERROR, "--progress needs --control-fd, or stdin "
+			"which is neither a terminal nor read for details");
+		exit_status = LAB_EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	/*
+	 * Leave it to the bar with the same tag or to the daemon if there is
+	 * one, before reading anything. Commands can only be read here.
+	 */
+	int fd = -1;
+	bool handoff = false;
+	if (nag.control.fd < 0) {
+		fd = nag.tag ? ipc_connect(nag.tag) : -1;
+		handoff = fd >= 0;
+		if (!handoff) {
+			fd = ipc_connect(NULL);
+		}
+	}
+	if (fd >= 0) {
+		bool sent = ipc_send_request(fd, argc, argv);
+		int status = sent ? ipc_read_reply(fd) : -1;
+		close(fd);
+		/* A bar going away before it took over is shown here instead */
+		if (sent && !(handoff && status < 0)) {
+			exit_status = status < 0 ? LAB_EXIT_FAILURE : status;
+			goto cleanup;
+		}
+	}
+
+	if (!nag_load_details(&nag)) {
+		exit_status = LAB_EXIT_FAILURE;
+		goto cleanup;
 	}
 
 	wlr_log(WLR_DEBUG, "Output: %s", nag.conf->output);
@@ -1645,9 +4244,22 @@ main(int argc, char **argv)
 		wlr_log(WLR_DEBUG, "\t[%s] `%s`", button->text, button->action);
 	}
 
-	nag_setup(&nag);
+	if (nag.tag) {
+		/* Taken by another bar if it just raced us to it */
+		nag.pollfds[FD_LISTEN].fd = ipc_listen(nag.tag);
+		nag.pollfds[FD_LISTEN].events = POLLIN;
+	}
 
-	nag_run(&nag);
+	nag_connect(&nag);
+	if (nag_show(&nag)) {
+		nag_run(&nag);
+	} else {
+		exit_status = LAB_EXIT_FAILURE;
+	}
+	if (nag.pollfds[FD_LISTEN].fd >= 0) {
+		ipc_close(nag.pollfds[FD_LISTEN].fd, nag.tag);
+		nag.pollfds[FD_LISTEN].fd = -1;
+	}
 
 cleanup:
 	nag_destroy(&nag);
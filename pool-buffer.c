@@ -4,7 +4,7 @@
  *
  * Copyright (C) 2016-2017 Drew DeVault
  */
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* memfd_create() */
 #include <assert.h>
 #include <cairo.h>
 #include <errno.h>
@@ -49,41 +49,189 @@ static void buffer_release(void *data, struct wl_buffer *wl_buffer)
 {
 	struct pool_buffer *buffer = data;
 	buffer->busy = false;
+	if (buffer->chain->release) {
+		buffer->chain->release(buffer->chain->data);
+	}
 }
 
 static const struct wl_buffer_listener buffer_listener = {
 	.release = buffer_release
 };
 
-static struct pool_buffer *create_buffer(struct wl_shm *shm,
+static int create_pool_fd(void)
+{
+#ifdef MFD_ALLOW_SEALING
+	int fd = memfd_create("labnag", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		// the pool only ever grows, so let the compositor rely on it
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+		return fd;
+	}
+#endif
+	return anonymous_shm_open();
+}
+
+void swapchain_init(struct swapchain *chain, struct wl_shm *shm,
+		uint32_t format, size_t max_buffers,
+		void (*release)(void *data), void *data)
+{
+	assert(max_buffers >= 2 && max_buffers <= SWAPCHAIN_MAX_BUFFERS);
+	assert(format == WL_SHM_FORMAT_ARGB8888
+		|| format == WL_SHM_FORMAT_XRGB8888);
+	*chain = (struct swapchain){
+		.pool = {
+			.shm = shm,
+			.fd = -1,
+		},
+		.nr_buffers = 2,
+		.max_buffers = max_buffers,
+		.format = format,
+		.release = release,
+		.data = data,
+	};
+	for (size_t i = 0; i < SWAPCHAIN_MAX_BUFFERS; ++i) {
+		chain->buffers[i].chain = chain;
+	}
+}
+
+void swapchain_finish(struct swapchain *chain)
+{
+	for (size_t i = 0; i < SWAPCHAIN_MAX_BUFFERS; ++i) {
+		destroy_buffer(&chain->buffers[i]);
+	}
+
+	struct shm_pool *pool = &chain->pool;
+	if (pool->pool) {
+		wl_shm_pool_destroy(pool->pool);
+		pool->pool = NULL;
+	}
+	if (pool->data) {
+		munmap(pool->data, pool->size);
+		pool->data = NULL;
+	}
+	if (pool->fd >= 0) {
+		close(pool->fd);
+		pool->fd = -1;
+	}
+	pool->size = 0;
+}
+
+static void buffer_map(struct pool_buffer *buf, struct shm_pool *pool)
+{
+	// both have the same memory layout, RGB24 just ignores the alpha byte
+	cairo_format_t format = buf->chain->format == WL_SHM_FORMAT_XRGB8888
+		? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32;
+	buf->surface = cairo_image_surface_create_for_data(
+			(unsigned char *)pool->data + buf->offset,
+			format, buf->width, buf->height, buf->width * 4);
+	buf->cairo = cairo_create(buf->surface);
+}
+
+static void buffer_unmap(struct pool_buffer *buf)
+{
+	if (buf->cairo) {
+		cairo_destroy(buf->cairo);
+		buf->cairo = NULL;
+	}
+	if (buf->surface) {
+		cairo_surface_destroy(buf->surface);
+		buf->surface = NULL;
+	}
+}
+
+// grow the pool to @size bytes and move the mappings of live buffers
+static bool pool_grow(struct swapchain *chain, size_t size)
+{
+	struct shm_pool *pool = &chain->pool;
+	if (pool->fd < 0) {
+		pool->fd = create_pool_fd();
+		if (pool->fd < 0) {
+			return false;
+		}
+	}
+	if (ftruncate(pool->fd, size) < 0) {
+		return false;
+	}
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			pool->fd, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	if (pool->pool) {
+		wl_shm_pool_resize(pool->pool, size);
+	} else {
+		pool->pool = wl_shm_create_pool(pool->shm, pool->fd, size);
+	}
+
+	for (size_t i = 0; i < chain->nr_buffers; ++i) {
+		if (chain->buffers[i].buffer) {
+			buffer_unmap(&chain->buffers[i]);
+		}
+	}
+	if (pool->data) {
+		munmap(pool->data, pool->size);
+	}
+	pool->data = data;
+	pool->size = size;
+	for (size_t i = 0; i < chain->nr_buffers; ++i) {
+		if (chain->buffers[i].buffer) {
+			buffer_map(&chain->buffers[i], pool);
+		}
+	}
+	return true;
+}
+
+static bool range_free(struct swapchain *chain, size_t offset, size_t size)
+{
+	for (size_t i = 0; i < chain->nr_buffers; ++i) {
+		struct pool_buffer *buf = &chain->buffers[i];
+		if (buf->buffer && offset < buf->offset + buf->size
+				&& buf->offset < offset + size) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// first fit among the live buffers, or past the last one
+static size_t find_offset(struct swapchain *chain, size_t size)
+{
+	if (range_free(chain, 0, size)) {
+		return 0;
+	}
+	size_t offset = SIZE_MAX;
+	for (size_t i = 0; i < chain->nr_buffers; ++i) {
+		struct pool_buffer *buf = &chain->buffers[i];
+		size_t end = buf->offset + buf->size;
+		if (buf->buffer && end < offset
+				&& range_free(chain, end, size)) {
+			offset = end;
+		}
+	}
+	return offset;
+}
+
+static struct pool_buffer *create_buffer(struct swapchain *chain,
 		struct pool_buffer *buf, int32_t width, int32_t height,
 		uint32_t format)
 {
 	uint32_t stride = width * 4;
 	size_t size = stride * height;
 
-	int fd = anonymous_shm_open();
-	if (fd == -1) {
+	size_t offset = find_offset(chain, size);
+	if (offset + size > chain->pool.size
+			&& !pool_grow(chain, offset + size)) {
 		return NULL;
 	}
-	if (ftruncate(fd, size) < 0) {
-		close(fd);
-		return NULL;
-	}
-	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-	buf->buffer = wl_shm_pool_create_buffer(pool, 0,
+	buf->buffer = wl_shm_pool_create_buffer(chain->pool.pool, offset,
 			width, height, stride, format);
-	wl_shm_pool_destroy(pool);
-	close(fd);
 
+	buf->offset = offset;
 	buf->size = size;
 	buf->width = width;
 	buf->height = height;
-	buf->data = data;
-	buf->surface = cairo_image_surface_create_for_data(data,
-			CAIRO_FORMAT_ARGB32, width, height, stride);
-	buf->cairo = cairo_create(buf->surface);
+	buffer_map(buf, &chain->pool);
 	buf->pango = pango_cairo_create_context(buf->cairo);
 
 	wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
@@ -96,37 +244,34 @@ void destroy_buffer(struct pool_buffer *buffer)
 		wl_buffer_destroy(buffer->buffer);
 		buffer->buffer = NULL;
 	}
-	if (buffer->cairo) {
-		cairo_destroy(buffer->cairo);
-		buffer->cairo = NULL;
-	}
-	if (buffer->surface) {
-		cairo_surface_destroy(buffer->surface);
-		buffer->surface = NULL;
-	}
+	buffer_unmap(buffer);
 	if (buffer->pango) {
 		g_object_unref(buffer->pango);
 		buffer->pango = NULL;
 	}
-	if (buffer->data) {
-		munmap(buffer->data, buffer->size);
-		buffer->data = NULL;
-	}
+	buffer->offset = 0;
+	buffer->size = 0;
+	buffer->busy = false;
 }
 
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height)
+struct pool_buffer *get_next_buffer(struct swapchain *chain,
+		uint32_t width, uint32_t height)
 {
 	struct pool_buffer *buffer = NULL;
 
-	for (size_t i = 0; i < 2; ++i) {
-		if (pool[i].busy) {
+	for (size_t i = 0; i < chain->nr_buffers; ++i) {
+		if (chain->buffers[i].busy) {
 			continue;
 		}
-		buffer = &pool[i];
+		buffer = &chain->buffers[i];
 	}
 
+	if (!buffer && chain->nr_buffers < chain->max_buffers) {
+		// the compositor holds on to all of them, so add one
+		buffer = &chain->buffers[chain->nr_buffers++];
+	}
 	if (!buffer) {
+		++chain->nr_stalls;
 		return NULL;
 	}
 
@@ -135,11 +280,16 @@ struct pool_buffer *get_next_buffer(struct wl_shm *shm,
 	}
 
 	if (!buffer->buffer) {
-		if (!create_buffer(shm, buffer, width, height,
-					WL_SHM_FORMAT_ARGB8888)) {
+		if (!create_buffer(chain, buffer, width, height,
+					chain->format)) {
 			return NULL;
 		}
 	}
 	buffer->busy = true;
 	return buffer;
 }
+
+void swapchain_cancel(struct pool_buffer *buffer)
+{
+	buffer->busy = false;
+}
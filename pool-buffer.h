@@ -12,19 +12,63 @@
 #include <stdint.h>
 #include <wayland-client.h>
 
+#define SWAPCHAIN_MAX_BUFFERS 4
+
+/* The shm pool all buffers of a surface are sub-allocated from */
+struct shm_pool {
+	struct wl_shm *shm;
+	struct wl_shm_pool *pool;
+	int fd;
+	void *data;
+	size_t size;
+};
+
+struct swapchain;
+
 struct pool_buffer {
+	struct swapchain *chain;
 	struct wl_buffer *buffer;
 	cairo_surface_t *surface;
 	cairo_t *cairo;
 	PangoContext *pango;
 	uint32_t width, height;
-	void *data;
+	size_t offset; /* into the pool */
 	size_t size;
 	bool busy;
 };
 
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height);
+/*
+ * Buffers for one surface. It starts with two and adds more, up to
+ * max_buffers, while the compositor holds on to all of them. The pool only
+ * ever grows, so size changes reuse its memory.
+ */
+struct swapchain {
+	struct shm_pool pool;
+	struct pool_buffer buffers[SWAPCHAIN_MAX_BUFFERS];
+	size_t nr_buffers;
+	size_t max_buffers;
+	uint32_t format; /* WL_SHM_FORMAT_ARGB8888 or XRGB8888 */
+	unsigned int nr_stalls; /* times all buffers were busy */
+
+	/* Called when a buffer is released by the compositor */
+	void (*release)(void *data);
+	void *data;
+};
+
+void swapchain_init(struct swapchain *chain, struct wl_shm *shm,
+		uint32_t format, size_t max_buffers,
+		void (*release)(void *data), void *data);
+void swapchain_finish(struct swapchain *chain);
+
+/*
+ * Returns NULL if all buffers are busy, in which case the release callback
+ * tells when to try again.
+ */
+struct pool_buffer *get_next_buffer(struct swapchain *chain,
+		uint32_t width, uint32_t height);
+
+/* Hand back a buffer from get_next_buffer() which was not attached */
+void swapchain_cancel(struct pool_buffer *buffer);
 void destroy_buffer(struct pool_buffer *buffer);
 
 #endif /* LAB_POOL_BUFFER_H */